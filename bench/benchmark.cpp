@@ -0,0 +1,647 @@
+/* benchmark.cpp
+ * Benchmarks for lazy-cartesian-product.hpp
+ *
+ * Licensed under the MIT license
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <streambuf>
+#include <functional>
+#include <algorithm>
+#include <fstream>
+#include <ctime>
+#include "../lazy-cartesian-product.hpp"
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using std::cout;
+using std::function;
+using std::ostringstream;
+using std::setw;
+using std::streambuf;
+
+using lazycp::batch_random;
+using lazycp::cartesian_product;
+using lazycp::index_type;
+using lazycp::lazy_cartesian_product;
+using lazycp::precomputed_stats;
+using lazycp::sample_batch;
+
+namespace
+{
+    // A streambuf that throws its output away but counts the bytes.
+    class null_buffer: public streambuf
+    {
+        public:
+            null_buffer(): bytes(0) {}
+            unsigned long long bytes;
+
+        protected:
+            std::streamsize xsputn(const char *, std::streamsize count)
+            {
+                bytes += count;
+                return count;
+            }
+            int overflow(int c)
+            {
+                ++bytes;
+                return c;
+            }
+    };
+
+    // Hardware counters read through perf_event_open around each timed run.
+    // On other platforms, or when the kernel refuses access, open() fails and
+    // the benchmarks are reported without counters.
+    class perf_counters
+    {
+        public:
+            static const int count = 4;
+
+            perf_counters()
+            {
+                for (int i = 0; i < count; ++i)
+                {
+                    fds[i] = -1;
+                }
+            }
+            ~perf_counters()
+            {
+#ifdef __linux__
+                for (int i = 0; i < count; ++i)
+                {
+                    if (fds[i] >= 0)
+                    {
+                        close(fds[i]);
+                    }
+                }
+#endif
+            }
+
+            static const char *name(const int &counter)
+            {
+                static const char *names[count] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+                return names[counter];
+            }
+            bool open(void)
+            {
+#ifdef __linux__
+                const unsigned long long configs[count] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+                for (int i = 0; i < count; ++i)
+                {
+                    struct perf_event_attr attr;
+                    std::memset(&attr, 0, sizeof(attr));
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.size = sizeof(attr);
+                    attr.config = configs[i];
+                    attr.disabled = 1;
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv = 1;
+                    fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+                    if (fds[i] < 0)
+                    {
+                        return false;
+                    }
+                }
+                return true;
+#else
+                return false;
+#endif
+            }
+            void start(void)
+            {
+#ifdef __linux__
+                for (int i = 0; i < count; ++i)
+                {
+                    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+                }
+#endif
+            }
+            // Adds the counts since start() to `totals`.
+            void stop(vector<double> &totals)
+            {
+#ifdef __linux__
+                for (int i = 0; i < count; ++i)
+                {
+                    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+                }
+                for (int i = 0; i < count; ++i)
+                {
+                    unsigned long long value = 0;
+                    if (read(fds[i], &value, sizeof(value)) == sizeof(value))
+                    {
+                        totals[i] += value;
+                    }
+                }
+#endif
+            }
+
+        private:
+            int fds[count];
+    };
+
+    struct fixture
+    {
+        string                 name;
+        vector<vector<string>> combinations;
+    };
+
+    // Values are drawn from a fixed seed so every run sees the same spec.
+    const vector<string> make_dimension(mt19937_64 &gen, const unsigned long long &size)
+    {
+        vector<string> values(size);
+        for (unsigned long long i = 0; i < size; ++i)
+        {
+            ostringstream value;
+            value << "v" << i;
+            unsigned long long padding = gen() % 24;
+            for (unsigned long long k = 0; k < padding; ++k)
+            {
+                value << (char)('a' + gen() % 26);
+            }
+            values[i] = value.str();
+        }
+        return values;
+    }
+
+    const fixture make_fixture(const string &name, const vector<unsigned long long> &sizes)
+    {
+        mt19937_64 gen(sizes.size());
+        fixture f;
+        f.name = name;
+        for (const unsigned long long &size: sizes)
+        {
+            f.combinations.push_back(make_dimension(gen, size));
+        }
+        return f;
+    }
+
+    const vector<fixture> make_fixtures(void)
+    {
+        vector<fixture> fixtures;
+        fixtures.push_back(make_fixture("few_large", { 1000, 800, 600 }));
+
+        vector<unsigned long long> tiny;
+        for (unsigned long long i = 0; i < 24; ++i)
+        {
+            tiny.push_back(2 + i % 3);
+        }
+        fixtures.push_back(make_fixture("many_tiny", tiny));
+        fixtures.push_back(make_fixture("skewed", { 100000, 2, 5, 3, 2, 7 }));
+        fixtures.push_back(make_fixture("export", { 20, 10, 8, 6, 5 }));
+
+        vector<unsigned long long> wide;
+        for (unsigned long long i = 0; i < 15; ++i)
+        {
+            wide.push_back(16);
+        }
+        fixtures.push_back(make_fixture("space_64bit", wide));
+#ifdef USE_BOOST
+        vector<unsigned long long> huge;
+        for (unsigned long long i = 0; i < 100; ++i)
+        {
+            huge.push_back(1000);
+        }
+        fixtures.push_back(make_fixture("space_1024bit", huge));
+#endif
+        return fixtures;
+    }
+
+    // Draws reproducible indices below max_size.
+    const vector<index_type> make_indices(const index_type &max_size, const unsigned long long &count)
+    {
+        mt19937_64 gen(count);
+        vector<index_type> indices(count);
+        for (index_type &index: indices)
+        {
+#ifdef USE_BOOST
+            for (int word = 0; word < 16; ++word)
+            {
+                index = (index << 64) | uint1024_t(gen());
+            }
+            index %= max_size;
+#else
+            index = gen() % max_size;
+#endif
+        }
+        return indices;
+    }
+
+    const unsigned long long result_bytes(const vector<vector<string>> &rows)
+    {
+        const unsigned long long inline_capacity = string().capacity();
+        unsigned long long bytes = sizeof(rows) + rows.capacity() * sizeof(vector<string>);
+        for (const vector<string> &row: rows)
+        {
+            bytes += row.capacity() * sizeof(string);
+            for (const string &value: row)
+            {
+                if (value.capacity() > inline_capacity)
+                {
+                    bytes += value.capacity() + 1;
+                }
+            }
+        }
+        return bytes;
+    }
+
+    struct options
+    {
+        double             min_seconds;
+        unsigned long long repetitions;
+        string             filter;
+        perf_counters      *perf;
+    };
+
+    struct measurement
+    {
+        string             name;
+        unsigned long long operations;
+        double             seconds;
+        vector<double>     samples;
+        double             median;
+        double             ci_low;
+        double             ci_high;
+        vector<double>     counters;
+        string             extra;
+    };
+
+    // Distribution-free ~95% confidence interval for the median, taken from
+    // the order statistics of the sorted samples.
+    void summarize(measurement &m)
+    {
+        vector<double> sorted(m.samples.begin(), m.samples.end());
+        std::sort(sorted.begin(), sorted.end());
+        const unsigned long long n = sorted.size();
+        m.median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+        unsigned long long k = 0;
+        double cumulative = 0;
+        double choose = 1;
+        for (unsigned long long i = 0; i < n / 2; ++i)
+        {
+            cumulative += choose * std::pow(0.5, (double)n);
+            if (cumulative > 0.025)
+            {
+                break;
+            }
+            k = i;
+            choose = choose * (n - i) / (i + 1);
+        }
+        m.ci_low = sorted[k];
+        m.ci_high = sorted[n - 1 - k];
+    }
+
+    // Runs `run` (which returns the number of operations it performed) for
+    // `repetitions` samples, each repeating it until at least `min_seconds`
+    // have passed. Benchmarks not matching the filter are not run.
+    const measurement measure(const string &name, const options &opts, function<unsigned long long(void)> run)
+    {
+        measurement m;
+        m.name = name;
+        m.operations = 0;
+        m.seconds = 0;
+        if (name.find(opts.filter) == string::npos)
+        {
+            return m;
+        }
+
+        if (opts.perf)
+        {
+            m.counters.assign(perf_counters::count, 0);
+        }
+        for (unsigned long long r = 0; r < opts.repetitions; ++r)
+        {
+            unsigned long long operations = 0;
+            double seconds = 0;
+            while (seconds < opts.min_seconds)
+            {
+                if (opts.perf)
+                {
+                    opts.perf->start();
+                }
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                operations += run();
+                seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (opts.perf)
+                {
+                    opts.perf->stop(m.counters);
+                }
+            }
+            m.operations += operations;
+            m.seconds += seconds;
+            m.samples.push_back(seconds * 1e9 / operations);
+        }
+        for (double &counter: m.counters)
+        {
+            counter /= m.operations;
+        }
+        summarize(m);
+        return m;
+    }
+
+    void report(const measurement &m)
+    {
+        cout << std::left << setw(44) << m.name << std::right << std::fixed << std::setprecision(1)
+             << setw(14) << m.median << " ns/op"
+             << "  [" << m.ci_low << ", " << m.ci_high << "]"
+             << setw(16) << std::setprecision(0) << 1e9 / m.median << " op/s";
+        if (!m.counters.empty())
+        {
+            cout << std::setprecision(1) << "  cyc/op " << m.counters[0] << "  ins/op " << m.counters[1]
+                 << std::setprecision(2) << "  ipc " << (m.counters[0] > 0 ? m.counters[1] / m.counters[0] : 0)
+                 << std::setprecision(3) << "  llc-miss/op " << m.counters[2] << "  br-miss/op " << m.counters[3];
+        }
+        if (!m.extra.empty())
+        {
+            cout << "  " << m.extra;
+        }
+        cout << "\n";
+    }
+
+    const string json_escape(const string &text)
+    {
+        string escaped;
+        for (const char &c: text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped.push_back('\\');
+            }
+            escaped.push_back(c);
+        }
+        return escaped;
+    }
+
+    void write_json(const string &path, const options &opts, const vector<measurement> &results)
+    {
+        std::ofstream out(path.c_str());
+        if (!out)
+        {
+            throw runtime_error("Could not open " + path);
+        }
+
+        out << std::setprecision(6) << std::fixed;
+        out << "{\n  \"context\": {\"boost\": ";
+#ifdef USE_BOOST
+        out << "true";
+#else
+        out << "false";
+#endif
+        out << ", \"timestamp\": " << (long long)std::time(0) << ", \"repetitions\": " << opts.repetitions
+            << ", \"min_time\": " << opts.min_seconds << "},\n  \"benchmarks\": [";
+        bool first = true;
+        for (const measurement &m: results)
+        {
+            if (m.samples.empty())
+            {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    {\"name\": \"" << json_escape(m.name) << "\", \"unit\": \"ns/op\""
+                << ", \"median\": " << m.median << ", \"ci_low\": " << m.ci_low << ", \"ci_high\": " << m.ci_high
+                << ", \"samples\": [";
+            for (unsigned long long i = 0; i < m.samples.size(); ++i)
+            {
+                out << (i ? ", " : "") << m.samples[i];
+            }
+            out << "]";
+            if (!m.counters.empty())
+            {
+                out << ", \"counters_per_op\": {";
+                for (int i = 0; i < perf_counters::count; ++i)
+                {
+                    out << (i ? ", " : "") << "\"" << perf_counters::name(i) << "\": " << m.counters[i];
+                }
+                out << "}";
+            }
+            out << "}";
+            first = false;
+        }
+        out << "\n  ]\n}\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    options opts;
+    opts.min_seconds = 0.2;
+    opts.repetitions = 5;
+    opts.perf = 0;
+    perf_counters perf;
+    string json;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg(argv[i]);
+        if (arg == "--min-time" && i + 1 < argc)
+        {
+            opts.min_seconds = std::stod(argv[++i]);
+        }
+        else if (arg == "--repetitions" && i + 1 < argc)
+        {
+            opts.repetitions = std::max(1ULL, std::stoull(argv[++i]));
+        }
+        else if (arg == "--filter" && i + 1 < argc)
+        {
+            opts.filter = argv[++i];
+        }
+        else if (arg == "--perf")
+        {
+            if (perf.open())
+            {
+                opts.perf = &perf;
+            }
+            else
+            {
+                std::cerr << "warning: hardware counters are unavailable, continuing without them\n";
+            }
+        }
+        else if (arg == "--json" && i + 1 < argc)
+        {
+            json = argv[++i];
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--min-time seconds] [--repetitions n] [--filter substring] [--perf] [--json path]\n";
+            return 1;
+        }
+    }
+
+    const unsigned long long lookups = 4096;
+    const unsigned long long enumerated = 1 << 20;
+    const unsigned long long sample_size = 10000;
+    unsigned long long checksum = 0;
+    vector<measurement> results;
+
+    for (const fixture &f: make_fixtures())
+    {
+        const vector<vector<string>> &spec = f.combinations;
+        cartesian_product product(spec);
+        const index_type max_size = product.max_size();
+        const vector<index_type> indices = make_indices(max_size, lookups);
+        const string prefix = f.name + "/";
+
+#ifdef USE_BOOST
+        const precomputed_stats plain = lazy_cartesian_product::boost_precompute(spec);
+        const precomputed_stats fused = lazy_cartesian_product::boost_precompute(spec, LCP_FUSION_LIMIT);
+        results.push_back(measure(prefix + "boost_entry_at/plain", opts, [&]()
+        {
+            for (const index_type &index: indices)
+            {
+                checksum += lazy_cartesian_product::boost_entry_at(spec, index, plain)[0].size();
+            }
+            return lookups;
+        }));
+        results.push_back(measure(prefix + "boost_entry_at/fused", opts, [&]()
+        {
+            for (const index_type &index: indices)
+            {
+                checksum += lazy_cartesian_product::boost_entry_at(spec, index, fused)[0].size();
+            }
+            return lookups;
+        }));
+        vector<string> textual;
+        for (unsigned long long i = 0; i < 256; ++i)
+        {
+            textual.push_back(indices[i].convert_to<string>());
+        }
+        results.push_back(measure(prefix + "boost_entry_at/string_index", opts, [&]()
+        {
+            for (const string &index: textual)
+            {
+                checksum += lazy_cartesian_product::boost_entry_at(spec, index)[0].size();
+            }
+            return (unsigned long long)textual.size();
+        }));
+#else
+        const precomputed_stats plain = lazy_cartesian_product::precompute(spec);
+        const precomputed_stats fused = lazy_cartesian_product::precompute(spec, LCP_FUSION_LIMIT);
+        results.push_back(measure(prefix + "entry_at/plain", opts, [&]()
+        {
+            for (const index_type &index: indices)
+            {
+                checksum += lazy_cartesian_product::entry_at(spec, index, plain)[0].size();
+            }
+            return lookups;
+        }));
+        results.push_back(measure(prefix + "entry_at/fused", opts, [&]()
+        {
+            for (const index_type &index: indices)
+            {
+                checksum += lazy_cartesian_product::entry_at(spec, index, fused)[0].size();
+            }
+            return lookups;
+        }));
+#endif
+        results.push_back(measure(prefix + "cartesian_product/entry_at", opts, [&]()
+        {
+            for (const index_type &index: indices)
+            {
+                checksum += product.entry_at(index)[0].size();
+            }
+            return lookups;
+        }));
+
+        const index_type last = max_size < enumerated ? max_size : index_type(enumerated);
+        results.push_back(measure(prefix + "for_each", opts, [&]()
+        {
+            product.for_each(0, last, [&](const vector<string> &row)
+            {
+                checksum += row[0].size();
+            });
+            return (unsigned long long)last;
+        }));
+
+        if (max_size <= enumerated)
+        {
+            null_buffer buffer;
+            std::ostream out(&buffer);
+            measurement m = measure(prefix + "write_all", opts, [&]()
+            {
+                lazy_cartesian_product::write_all(spec, out);
+                return (unsigned long long)max_size;
+            });
+            ostringstream extra;
+            extra << std::fixed << std::setprecision(1) << buffer.bytes / m.seconds / 1e6 << " MB/s";
+            m.extra = extra.str();
+            results.push_back(m);
+        }
+
+        if (max_size > sample_size)
+        {
+            unsigned long long bytes = 0;
+            measurement m = measure(prefix + "generate_samples", opts, [&]()
+            {
+#ifdef USE_BOOST
+                const vector<vector<string>> rows = lazy_cartesian_product::boost_generate_samples(spec, std::to_string(sample_size));
+#else
+                const vector<vector<string>> rows = lazy_cartesian_product::generate_samples(spec, sample_size);
+#endif
+                bytes = result_bytes(rows);
+                return sample_size;
+            });
+            ostringstream extra;
+            extra << bytes / sample_size << " B/row";
+            m.extra = extra.str();
+            results.push_back(m);
+        }
+
+        if (max_size > sample_size)
+        {
+            results.push_back(measure(prefix + "generate_samples_into/arena", opts, [&]()
+            {
+                sample_batch batch;
+#ifdef USE_BOOST
+                lazy_cartesian_product::boost_generate_samples_into(spec, std::to_string(sample_size), batch.rows);
+#else
+                lazy_cartesian_product::generate_samples_into(spec, sample_size, batch.rows);
+#endif
+                checksum += batch.rows.size();
+                return sample_size;
+            }));
+        }
+    }
+
+    const unsigned long long words = 1 << 16;
+    mt19937_64 scalar_gen(42);
+    results.push_back(measure("rng/mt19937_64", opts, [&]()
+    {
+        for (unsigned long long i = 0; i < words; ++i)
+        {
+            checksum += scalar_gen();
+        }
+        return words;
+    }));
+    batch_random batch_gen(42);
+    results.push_back(measure("rng/batch_random", opts, [&]()
+    {
+        for (unsigned long long i = 0; i < words; ++i)
+        {
+            checksum += batch_gen();
+        }
+        return words;
+    }));
+
+    for (const measurement &m: results)
+    {
+        if (!m.samples.empty())
+        {
+            report(m);
+        }
+    }
+    if (!json.empty())
+    {
+        write_json(json, opts, results);
+    }
+    // Stored once so the measured calls cannot be optimized away.
+    volatile unsigned long long sink = checksum;
+    (void)sink;
+    return 0;
+}
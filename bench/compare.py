@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""Compares a benchmark run against a stored baseline.
+
+Both files are the JSON written by `benchmark --json`. For every benchmark
+present in both, the medians are compared and a one-sided Mann-Whitney U
+test on the per-repetition samples decides whether a slowdown is
+significant. The exit status is 1 when a gated benchmark (decode and
+sampling paths by default) is both significantly slower and slower by more
+than the threshold.
+"""
+
+import argparse
+import itertools
+import json
+import math
+import re
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data.get("context", {}), {b["name"]: b for b in data["benchmarks"]}
+
+
+def exact_p_value(u, n1, n2):
+    """P(U <= u) under the null hypothesis, by counting rank assignments."""
+    # counts[(i, j)][k]: number of orderings of i + j values with U == k
+    counts = {(0, 0): {0: 1}}
+    for i in range(n1 + 1):
+        for j in range(n2 + 1):
+            if i == 0 and j == 0:
+                continue
+            dist = {}
+            if i > 0:
+                # the largest value belongs to the first sample: adds j to U
+                for k, c in counts[(i - 1, j)].items():
+                    dist[k + j] = dist.get(k + j, 0) + c
+            if j > 0:
+                for k, c in counts[(i, j - 1)].items():
+                    dist[k] = dist.get(k, 0) + c
+            counts[(i, j)] = dist
+    dist = counts[(n1, n2)]
+    total = sum(dist.values())
+    return sum(c for k, c in dist.items() if k <= u) / total
+
+
+def slower_p_value(baseline, current):
+    """One-sided Mann-Whitney U test that `current` is larger than `baseline`."""
+    n1, n2 = len(baseline), len(current)
+    # U counts the pairs where the baseline sample is larger than the current one
+    u = sum(1.0 if b > c else 0.5 if b == c else 0.0
+            for b, c in itertools.product(baseline, current))
+    ties = len(set(baseline) | set(current)) < n1 + n2
+    if not ties and n1 * n2 <= 400:
+        return exact_p_value(int(u), n1, n2)
+
+    mean = n1 * n2 / 2.0
+    sd = math.sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0)
+    if sd == 0:
+        return 1.0
+    z = (u + 0.5 - mean) / sd
+    return 0.5 * math.erfc(-z / math.sqrt(2))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="relative median slowdown that counts as a regression (default 0.05)")
+    parser.add_argument("--alpha", type=float, default=0.05,
+                        help="significance level of the U test (default 0.05)")
+    parser.add_argument("--gate", default="entry_at|for_each|generate_samples|write_all",
+                        help="regex of benchmark names that fail the run when they regress")
+    args = parser.parse_args()
+
+    base_context, baseline = load(args.baseline)
+    current_context, current = load(args.current)
+    if base_context.get("boost") != current_context.get("boost"):
+        print("warning: comparing a Boost build against a non-Boost build", file=sys.stderr)
+
+    gate = re.compile(args.gate)
+    failed = []
+    print("%-44s %12s %12s %9s %8s" % ("benchmark", "baseline", "current", "change", "p"))
+    for name in sorted(set(baseline) & set(current)):
+        b, c = baseline[name], current[name]
+        change = c["median"] / b["median"] - 1.0
+        p = slower_p_value(b["samples"], c["samples"])
+        regressed = change > args.threshold and p < args.alpha
+        mark = ""
+        if regressed:
+            mark = "  REGRESSION" if gate.search(name) else "  slower"
+            if gate.search(name):
+                failed.append(name)
+        print("%-44s %12.1f %12.1f %+8.1f%% %8.4f%s" % (name, b["median"], c["median"], change * 100, p, mark))
+
+    for name in sorted(set(baseline) - set(current)):
+        print("%-44s missing from the current run" % name)
+
+    if failed:
+        print("\n%d gated benchmark(s) regressed beyond %.1f%%" % (len(failed), args.threshold * 100))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,120 @@
+/* lazy-cartesian-product-kernels.cpp
+ * (c) Tyler Burdsall - 2018
+ *
+ * Licensed under the MIT license
+ *
+ * Optional compiled kernels for lazy-cartesian-product.hpp. Build this file
+ * once, link it, and define LCP_USE_KERNELS wherever the header is included.
+ * On x86-64 with GCC or Clang every kernel is cloned for AVX-512, AVX2 and
+ * the baseline ISA, and the dynamic loader resolves each clone from CPUID,
+ * so the including code keeps its own compiler flags.
+ */
+
+#ifndef LCP_USE_KERNELS
+#define LCP_USE_KERNELS
+#endif
+#include "lazy-cartesian-product.hpp"
+
+#if defined(__x86_64__) && defined(__ELF__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define LCP_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef LCP_KERNEL
+#define LCP_KERNEL
+#endif
+
+namespace lazycp
+{
+    namespace kernels
+    {
+        static inline unsigned long long rotate(const unsigned long long x, const int k)
+        {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        // The lane loop has no dependencies between lanes, so each clone
+        // vectorizes it for its own register width.
+        LCP_KERNEL void random_fill(unsigned long long state[4][4], unsigned long long *out, const unsigned long long count)
+        {
+            unsigned long long s0[4], s1[4], s2[4], s3[4];
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                s0[lane] = state[0][lane];
+                s1[lane] = state[1][lane];
+                s2[lane] = state[2][lane];
+                s3[lane] = state[3][lane];
+            }
+            for (unsigned long long i = 0; i < count; i += 4)
+            {
+                for (int lane = 0; lane < 4; ++lane)
+                {
+                    out[i + lane] = rotate(s1[lane] * 5, 7) * 9;
+                    const unsigned long long t = s1[lane] << 17;
+                    s2[lane] ^= s0[lane];
+                    s3[lane] ^= s1[lane];
+                    s1[lane] ^= s2[lane];
+                    s0[lane] ^= s3[lane];
+                    s2[lane] ^= t;
+                    s3[lane] = rotate(s3[lane], 45);
+                }
+            }
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                state[0][lane] = s0[lane];
+                state[1][lane] = s1[lane];
+                state[2][lane] = s2[lane];
+                state[3][lane] = s3[lane];
+            }
+        }
+
+        // Fills each column as runs of equal values instead of stepping an
+        // odometer row by row: dimension d keeps its value for `run` rows
+        // (the product of the sizes after it), except for the first run,
+        // which ends once every later dimension has wrapped. Both are capped
+        // at rows + 1 so they cannot overflow.
+        LCP_KERNEL void fill_columns(const unsigned long long *digits, const unsigned long long *sizes, const unsigned long long dimensions, const unsigned long long rows, unsigned int *const *columns)
+        {
+            const unsigned long long cap = rows + 1;
+            unsigned long long run = 1;
+            unsigned long long first = 1;
+            for (unsigned long long k = dimensions; k > 0; --k)
+            {
+                const unsigned long long d = k - 1;
+                unsigned int *column = columns[d];
+                unsigned int value = (unsigned int)digits[d];
+                unsigned long long row = 0;
+                unsigned long long length = first;
+                while (row < rows)
+                {
+                    const unsigned long long end = rows - row < length ? rows : row + length;
+                    for (; row < end; ++row)
+                    {
+                        column[row] = value;
+                    }
+                    value = value + 1 == sizes[d] ? 0 : value + 1;
+                    length = run;
+                }
+
+                const unsigned long long tail = (sizes[d] - 1 - digits[d]);
+                first = tail > 0 && run > (cap - first) / tail ? cap : first + tail * run;
+                run = run > cap / sizes[d] ? cap : run * sizes[d];
+            }
+        }
+
+        const char *target(void)
+        {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+            if (__builtin_cpu_supports("avx512f"))
+            {
+                return "avx512f";
+            }
+            if (__builtin_cpu_supports("avx2"))
+            {
+                return "avx2";
+            }
+#endif
+            return "default";
+        }
+    }
+}
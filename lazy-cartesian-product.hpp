@@ -18,8 +18,51 @@
 
 #include <string>
 #include <fstream>
+#include <ostream>
+#include <istream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
+#ifndef LCP_NO_THREADS
+#include <thread>
+#include <condition_variable>
+#endif
+#include <functional>
+#include <exception>
 #include <stdexcept>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <utility>
+#include <new>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(LCP_NO_MMAP)
+#define LCP_HAS_MMAP
+#include <sys/mman.h>
+#endif
+#if defined(LCP_HAS_MMAP) && !defined(LCP_NO_SHARED_MEMORY)
+#define LCP_HAS_SHARED_MEMORY
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(LCP_NO_SIMD)
+#define LCP_HAS_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+
 #ifdef USE_BOOST
 #include <boost/multiprecision/cpp_int.hpp>
 #include <boost/random.hpp>
@@ -39,6 +82,8 @@ using std::vector;
 #endif
 
 using std::fstream;
+using std::ostream;
+using std::istream;
 using std::ios;
 using std::string;
 using std::out_of_range;
@@ -65,17 +110,305 @@ namespace lazycp
         {
             invalid_sample_size_error(): runtime_error("The given sample size cannot be out of range") {}
         };
+        struct memory_budget_error: public runtime_error
+        {
+            memory_budget_error(): runtime_error("The given sample size does not fit in the memory budget") {}
+        };
+        struct invalid_profile_error: public runtime_error
+        {
+            invalid_profile_error(): runtime_error("The given tuning profile could not be read") {}
+        };
+        struct invalid_checkpoint_error: public runtime_error
+        {
+            invalid_checkpoint_error(): runtime_error("The given checkpoint could not be read") {}
+        };
+        struct shared_memory_error: public runtime_error
+        {
+            shared_memory_error(): runtime_error("The shared chunk ledger could not be opened") {}
+        };
+        struct invalid_template_error: public runtime_error
+        {
+            invalid_template_error(): runtime_error("The given row template is invalid") {}
+        };
+        struct invalid_permutation_error: public runtime_error
+        {
+            invalid_permutation_error(): runtime_error("The given dimension order is not a permutation of the dimensions") {}
+        };
+        struct invalid_manifest_error: public runtime_error
+        {
+            invalid_manifest_error(): runtime_error("The given shard manifest could not be read") {}
+        };
+        struct file_error: public runtime_error
+        {
+            file_error(): runtime_error("The given file could not be opened") {}
+        };
+    }
+}
+
+namespace lazycp
+{
+    // Counters collected when LCP_INSTRUMENTATION is defined. Times are in
+    // nanoseconds: "decode" is turning indices into rows, "copy" is copying
+    // decoded values into results and buffers, and "output" is writing to
+    // streams. Without LCP_INSTRUMENTATION every snapshot is zero and the
+    // counting macros compile to nothing.
+    struct instrumentation_snapshot
+    {
+        unsigned long long rows_decoded;
+        unsigned long long bytes_copied;
+        unsigned long long allocations;
+        unsigned long long rng_draws;
+        unsigned long long precompute_ns;
+        unsigned long long decode_ns;
+        unsigned long long copy_ns;
+        unsigned long long output_ns;
+    };
+
+    namespace instrumentation
+    {
+#ifdef LCP_INSTRUMENTATION
+        inline instrumentation_snapshot &local(void)
+        {
+            thread_local instrumentation_snapshot counters = {};
+            return counters;
+        }
+
+        class timer
+        {
+            public:
+                timer(): start(std::chrono::steady_clock::now()) {}
+                const unsigned long long elapsed(void) const
+                {
+                    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                }
+
+            private:
+                std::chrono::steady_clock::time_point start;
+        };
+
+        // Totals shared by every thread working through one object.
+        class shared_counters
+        {
+            public:
+                shared_counters()
+                {
+                    for (std::atomic<unsigned long long> &counter: counters)
+                    {
+                        counter.store(0, std::memory_order_relaxed);
+                    }
+                }
+                shared_counters(const shared_counters &other)
+                {
+                    for (unsigned int i = 0; i < size; ++i)
+                    {
+                        counters[i].store(other.counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    }
+                }
+
+                void add(const instrumentation_snapshot &before, const instrumentation_snapshot &after)
+                {
+                    unsigned long long from[size], to[size];
+                    flatten(before, from);
+                    flatten(after, to);
+                    for (unsigned int i = 0; i < size; ++i)
+                    {
+                        counters[i].fetch_add(to[i] - from[i], std::memory_order_relaxed);
+                    }
+                }
+                const instrumentation_snapshot snapshot(void) const
+                {
+                    instrumentation_snapshot current;
+                    current.rows_decoded = counters[0].load(std::memory_order_relaxed);
+                    current.bytes_copied = counters[1].load(std::memory_order_relaxed);
+                    current.allocations = counters[2].load(std::memory_order_relaxed);
+                    current.rng_draws = counters[3].load(std::memory_order_relaxed);
+                    current.precompute_ns = counters[4].load(std::memory_order_relaxed);
+                    current.decode_ns = counters[5].load(std::memory_order_relaxed);
+                    current.copy_ns = counters[6].load(std::memory_order_relaxed);
+                    current.output_ns = counters[7].load(std::memory_order_relaxed);
+                    return current;
+                }
+
+            private:
+                static const unsigned int size = 8;
+
+                static void flatten(const instrumentation_snapshot &snapshot, unsigned long long *values)
+                {
+                    values[0] = snapshot.rows_decoded;
+                    values[1] = snapshot.bytes_copied;
+                    values[2] = snapshot.allocations;
+                    values[3] = snapshot.rng_draws;
+                    values[4] = snapshot.precompute_ns;
+                    values[5] = snapshot.decode_ns;
+                    values[6] = snapshot.copy_ns;
+                    values[7] = snapshot.output_ns;
+                }
+
+                std::atomic<unsigned long long> counters[size];
+        };
+
+        // Adds whatever the current thread counts during its lifetime to
+        // `target`. A scope opened while another scope for the same target
+        // is open on the thread adds nothing, so work done through nested
+        // calls (a for_each callback calling entry_at on the same product) is
+        // counted once. Scopes for different targets nest independently: a
+        // callback that works on another product is counted by both.
+        class scope
+        {
+            public:
+                scope(shared_counters &target): target(target), before(local()), outermost(enter(&target)) {}
+                ~scope()
+                {
+                    if (outermost)
+                    {
+                        vector<const shared_counters *> &open = active();
+                        open.erase(std::find(open.begin(), open.end(), &target));
+                        target.add(before, local());
+                    }
+                }
+
+            private:
+                static vector<const shared_counters *> &active(void)
+                {
+                    thread_local vector<const shared_counters *> targets;
+                    return targets;
+                }
+                static const bool enter(const shared_counters *target)
+                {
+                    vector<const shared_counters *> &open = active();
+                    if (std::find(open.begin(), open.end(), target) != open.end())
+                    {
+                        return false;
+                    }
+                    open.push_back(target);
+                    return true;
+                }
+
+                shared_counters          &target;
+                instrumentation_snapshot before;
+                const bool               outermost;
+        };
+#endif
+
+        // The counters of the calling thread since it started.
+        inline const instrumentation_snapshot thread_snapshot(void)
+        {
+#ifdef LCP_INSTRUMENTATION
+            return local();
+#else
+            instrumentation_snapshot empty = {};
+            return empty;
+#endif
+        }
     }
 }
 
+#ifdef LCP_INSTRUMENTATION
+#define LCP_COUNT(field, amount) (::lazycp::instrumentation::local().field += (amount))
+#define LCP_TIMER(name) ::lazycp::instrumentation::timer name
+#define LCP_TIME(name, field) (::lazycp::instrumentation::local().field += (name).elapsed())
+#define LCP_ATTRIBUTE_TO(counters) ::lazycp::instrumentation::scope lcp_attribution_scope(counters)
+#else
+#define LCP_COUNT(field, amount) ((void)0)
+#define LCP_TIMER(name)
+#define LCP_TIME(name, field) ((void)0)
+#define LCP_ATTRIBUTE_TO(counters)
+#endif
+
+#ifndef LCP_FUSION_LIMIT
+#define LCP_FUSION_LIMIT 256
+#endif
+
+#ifndef LCP_SUFFIX_BLOCK_SIZE
+#define LCP_SUFFIX_BLOCK_SIZE 65536
+#endif
+
+#ifndef LCP_CALIBRATION_ROWS
+#define LCP_CALIBRATION_ROWS 1024
+#endif
+
+#ifndef LCP_CACHE_BLOCK_ROWS
+#define LCP_CACHE_BLOCK_ROWS 4096
+#endif
+
+#ifndef LCP_PARALLEL_CHUNK_ROWS
+#define LCP_PARALLEL_CHUNK_ROWS 65536
+#endif
+
+#ifndef LCP_TRACE_EVENTS
+#define LCP_TRACE_EVENTS 65536
+#endif
+
+#ifndef LCP_PROGRESS_BATCH_ROWS
+#define LCP_PROGRESS_BATCH_ROWS 1024
+#endif
+
+#ifndef LCP_OUTPUT_BUFFER_SIZE
+#define LCP_OUTPUT_BUFFER_SIZE 1048576
+#endif
+
+#ifndef LCP_RNG_BATCH_WORDS
+#define LCP_RNG_BATCH_WORDS 256
+#endif
+
+#ifndef LCP_ARENA_BLOCK_SIZE
+#define LCP_ARENA_BLOCK_SIZE 4194304
+#endif
+
+#ifndef LCP_MEMORY_BUDGET
+#define LCP_MEMORY_BUDGET 1073741824ULL
+#endif
+
 namespace lazycp
 {
+#ifdef LCP_USE_KERNELS
+    // Implemented in lazy-cartesian-product-kernels.cpp, which is compiled
+    // once with a clone per instruction set; the loader picks the variant
+    // for the running CPU. Without LCP_USE_KERNELS the header uses its own
+    // inline code instead.
+    namespace kernels
+    {
+        // Advances four interleaved xoshiro256** lanes (state[word][lane])
+        // and writes `count` words, a multiple of 4, to `out`.
+        void random_fill(unsigned long long state[4][4], unsigned long long *out, const unsigned long long count);
+        // Writes the value indices of `rows` consecutive rows, starting at
+        // the row with value indices `digits`, into one column per dimension.
+        // Used for the range decodes of block_cache and parallel_writer.
+        void fill_columns(const unsigned long long *digits, const unsigned long long *sizes, const unsigned long long dimensions, const unsigned long long rows, unsigned int *const *columns);
+        // The instruction set the kernels run with: "avx512f", "avx2" or "default".
+        const char *target(void);
+    }
+
+#endif
+#ifdef USE_BOOST
+    typedef uint1024_t index_type;
+#else
+    typedef unsigned long long index_type;
+#endif
+
+    // A run of adjacent dimensions decoded with a single division. When more
+    // than one dimension is fused, `digits` holds the value index of every
+    // dimension for each of the `mod` sub-tuples (row-major, `count` wide).
+    // `div_shift` and `mod_bits` are -1 unless `div` or `mod` is a power of
+    // two, in which case the digit is taken with a shift and mask instead.
+    struct fused_group
+    {
+        unsigned long long     first;
+        unsigned long long     count;
+        index_type             div;
+        unsigned long long     mod;
+        vector<unsigned short> digits;
+        int                    div_shift;
+        int                    mod_bits;
+    };
+
 #ifdef USE_BOOST	
     struct precomputed_stats
     {
         vector<uint1024_t> divs;
         vector<uint1024_t> mods;
         uint1024_t max_size;
+        vector<fused_group> groups;
     };
 #else
     struct precomputed_stats
@@ -83,8 +416,355 @@ namespace lazycp
         vector<unsigned long long> divs;
         vector<unsigned long long> mods;
         unsigned long long max_size;
+        vector<fused_group> groups;
+    };
+#endif
+    struct progress_report
+    {
+        unsigned long long rows_done;
+        index_type         total;
+        double             fraction;
+        double             elapsed_seconds;
+        double             rows_per_second;
+        double             eta_seconds;
+    };
+
+    // Reports the progress of a long enumeration or sample from a monitor
+    // thread every `interval`, and once more when stopped or destroyed.
+    // Engines only bump a relaxed atomic counter, so the callback never runs
+    // on their hot path. `total` is the row count of the whole job, e.g. from
+    // compute_max_size or the sample size; the ETA is -1 until rows are done.
+    // With LCP_NO_THREADS there is no monitor thread, and add() runs the
+    // callback itself once `interval` has passed.
+    class progress_monitor
+    {
+        public:
+            progress_monitor(const index_type &total, std::function<void(const progress_report &)> callback, const std::chrono::milliseconds &interval = std::chrono::milliseconds(1000)): total(total), callback(callback), interval(interval), done(0), stopped(false), start(std::chrono::steady_clock::now())
+            {
+#ifdef LCP_NO_THREADS
+                due = start + interval;
+#else
+                monitor = std::thread([this]()
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    while (!changed.wait_for(guard, this->interval, [this]() { return stopped; }))
+                    {
+                        guard.unlock();
+                        this->callback(report());
+                        guard.lock();
+                    }
+                });
+#endif
+            }
+            ~progress_monitor()
+            {
+                stop();
+            }
+
+            void add(const unsigned long long &rows)
+            {
+                done.fetch_add(rows, std::memory_order_relaxed);
+#ifdef LCP_NO_THREADS
+                const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if (now >= due)
+                {
+                    due = now + interval;
+                    callback(report());
+                }
+#endif
+            }
+            const progress_report report(void) const
+            {
+                progress_report current;
+                current.rows_done = done.load(std::memory_order_relaxed);
+                current.total = total;
+                current.elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef USE_BOOST
+                const long double whole = total.convert_to<long double>();
+#else
+                const long double whole = (long double)total;
+#endif
+                current.fraction = whole > 0 ? (double)(current.rows_done / whole) : 1.0;
+                current.rows_per_second = current.elapsed_seconds > 0 ? current.rows_done / current.elapsed_seconds : 0;
+                current.eta_seconds = current.rows_done > 0 ? (double)((whole - current.rows_done) / current.rows_per_second) : -1;
+                return current;
+            }
+            // Stops the monitor thread and delivers a final report.
+            void stop(void)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (stopped)
+                    {
+                        return;
+                    }
+                    stopped = true;
+                }
+#ifndef LCP_NO_THREADS
+                changed.notify_all();
+                monitor.join();
+#endif
+                callback(report());
+            }
+
+        private:
+            const index_type                                   total;
+            std::function<void(const progress_report &)>       callback;
+            const std::chrono::milliseconds                    interval;
+            std::atomic<unsigned long long>                    done;
+            bool                                               stopped;
+            const std::chrono::steady_clock::time_point        start;
+            std::mutex                                         lock;
+#ifdef LCP_NO_THREADS
+            std::chrono::steady_clock::time_point              due;
+#else
+            std::condition_variable                            changed;
+            std::thread                                        monitor;
+#endif
+    };
+
+    // Passes rows on to a progress_monitor in batches of
+    // LCP_PROGRESS_BATCH_ROWS, and the remainder when destroyed, so engines
+    // touch the shared counter rarely. A null monitor makes it a no-op.
+    class progress_batch
+    {
+        public:
+            explicit progress_batch(progress_monitor *progress): progress(progress), pending(0) {}
+            progress_batch(const progress_batch &) = delete;
+            progress_batch &operator=(const progress_batch &) = delete;
+            ~progress_batch()
+            {
+                if (progress && pending > 0)
+                {
+                    progress->add(pending);
+                }
+            }
+
+            void add_row(void)
+            {
+                if (progress && ++pending == LCP_PROGRESS_BATCH_ROWS)
+                {
+                    progress->add(pending);
+                    pending = 0;
+                }
+            }
+
+        private:
+            progress_monitor   *progress;
+            unsigned long long pending;
+    };
+
+    // Four interleaved xoshiro256** generators that produce random words a
+    // buffer at a time. On x86 CPUs with AVX2 the four lanes advance
+    // together in one vector register; elsewhere a scalar loop produces the
+    // same sequence. It satisfies the UniformRandomBitGenerator interface, so
+    // it can stand in for mt19937_64 wherever a sample needs not be saved.
+    class batch_random
+    {
+        public:
+            typedef unsigned long long result_type;
+
+            explicit batch_random(unsigned long long seed): position(LCP_RNG_BATCH_WORDS)
+            {
+                // splitmix64 spreads the seed over the 16 state words
+                for (unsigned int word = 0; word < 4; ++word)
+                {
+                    for (unsigned int lane = 0; lane < 4; ++lane)
+                    {
+                        seed += 0x9e3779b97f4a7c15ULL;
+                        unsigned long long z = seed;
+                        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                        state[word][lane] = z ^ (z >> 31);
+                    }
+                }
+            }
+
+            static constexpr result_type min(void)
+            {
+                return 0;
+            }
+            static constexpr result_type max(void)
+            {
+                return ~0ULL;
+            }
+            const result_type operator()(void)
+            {
+                if (position == LCP_RNG_BATCH_WORDS)
+                {
+                    refill();
+                }
+                return buffer[position++];
+            }
+            // Fills out[0, count) with the next `count` words.
+            void fill(unsigned long long *out, unsigned long long count)
+            {
+                while (count > 0)
+                {
+                    if (position == LCP_RNG_BATCH_WORDS)
+                    {
+                        refill();
+                    }
+                    unsigned long long taken = LCP_RNG_BATCH_WORDS - position;
+                    taken = taken < count ? taken : count;
+                    std::copy(buffer + position, buffer + position + taken, out);
+                    position += taken;
+                    out += taken;
+                    count -= taken;
+                }
+            }
+
+        private:
+            void refill(void)
+            {
+#ifdef LCP_USE_KERNELS
+                kernels::random_fill(state, buffer, LCP_RNG_BATCH_WORDS);
+#else
+#ifdef LCP_HAS_AVX2_DISPATCH
+                static const bool avx2 = __builtin_cpu_supports("avx2");
+                if (avx2)
+                {
+                    generate_avx2();
+                    position = 0;
+                    return;
+                }
+#endif
+                generate_scalar();
+#endif
+                position = 0;
+            }
+            static const unsigned long long rotate(const unsigned long long &x, const int &k)
+            {
+                return (x << k) | (x >> (64 - k));
+            }
+            void generate_scalar(void)
+            {
+                for (unsigned int i = 0; i < LCP_RNG_BATCH_WORDS; i += 4)
+                {
+                    for (unsigned int lane = 0; lane < 4; ++lane)
+                    {
+                        unsigned long long &s0 = state[0][lane];
+                        unsigned long long &s1 = state[1][lane];
+                        unsigned long long &s2 = state[2][lane];
+                        unsigned long long &s3 = state[3][lane];
+                        buffer[i + lane] = rotate(s1 * 5, 7) * 9;
+                        const unsigned long long t = s1 << 17;
+                        s2 ^= s0;
+                        s3 ^= s1;
+                        s1 ^= s2;
+                        s0 ^= s3;
+                        s2 ^= t;
+                        s3 = rotate(s3, 45);
+                    }
+                }
+            }
+#ifdef LCP_HAS_AVX2_DISPATCH
+            // AVX2 has no 64-bit multiply, so x * 5 and x * 9 are shifts and adds.
+            __attribute__((target("avx2"))) void generate_avx2(void)
+            {
+                __m256i s0 = _mm256_loadu_si256((const __m256i *)state[0]);
+                __m256i s1 = _mm256_loadu_si256((const __m256i *)state[1]);
+                __m256i s2 = _mm256_loadu_si256((const __m256i *)state[2]);
+                __m256i s3 = _mm256_loadu_si256((const __m256i *)state[3]);
+                for (unsigned int i = 0; i < LCP_RNG_BATCH_WORDS; i += 4)
+                {
+                    const __m256i times5 = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+                    const __m256i rotated = _mm256_or_si256(_mm256_slli_epi64(times5, 7), _mm256_srli_epi64(times5, 57));
+                    const __m256i result = _mm256_add_epi64(_mm256_slli_epi64(rotated, 3), rotated);
+                    _mm256_storeu_si256((__m256i *)(buffer + i), result);
+
+                    const __m256i t = _mm256_slli_epi64(s1, 17);
+                    s2 = _mm256_xor_si256(s2, s0);
+                    s3 = _mm256_xor_si256(s3, s1);
+                    s1 = _mm256_xor_si256(s1, s2);
+                    s0 = _mm256_xor_si256(s0, s3);
+                    s2 = _mm256_xor_si256(s2, t);
+                    s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+                }
+                _mm256_storeu_si256((__m256i *)state[0], s0);
+                _mm256_storeu_si256((__m256i *)state[1], s1);
+                _mm256_storeu_si256((__m256i *)state[2], s2);
+                _mm256_storeu_si256((__m256i *)state[3], s3);
+            }
+#endif
+
+            unsigned long long state[4][4];
+            unsigned long long buffer[LCP_RNG_BATCH_WORDS];
+            unsigned int       position;
     };
+
+    // Uniform integers below a bound from a 64-bit generator. 64-bit bounds
+    // use Lemire's multiply-shift method, which divides only when the low
+    // half of the product falls in the biased zone; wider bounds draw just
+    // as many 64-bit words as the bound has bits and reject values past it.
+    class bounded_random
+    {
+        public:
+            template <class Generator>
+            static const unsigned long long below(Generator &gen, const unsigned long long &bound)
+            {
+                unsigned long long low;
+                unsigned long long high = multiply(gen(), bound, low);
+                if (low < bound)
+                {
+                    const unsigned long long threshold = (0 - bound) % bound;
+                    while (low < threshold)
+                    {
+                        high = multiply(gen(), bound, low);
+                    }
+                }
+                return high;
+            }
+#ifdef USE_BOOST
+            template <class Generator>
+            static const uint1024_t below(Generator &gen, const uint1024_t &bound)
+            {
+                if (bound <= std::numeric_limits<unsigned long long>::max())
+                {
+                    return uint1024_t(below(gen, (unsigned long long)bound));
+                }
+
+                const unsigned int bits = msb(uint1024_t(bound - 1)) + 1;
+                const unsigned int words = (bits + 63) / 64;
+                const unsigned int top_bits = bits - 64 * (words - 1);
+                const unsigned long long mask = top_bits == 64 ? ~0ULL : (1ULL << top_bits) - 1;
+                unsigned long long limbs[1024 / 64];
+                uint1024_t value;
+                do
+                {
+                    for (unsigned int i = 0; i < words; ++i)
+                    {
+                        limbs[i] = gen();
+                    }
+                    limbs[words - 1] &= mask;
+                    import_bits(value, limbs, limbs + words, 64, false);
+                }
+                while (value >= bound);
+                return value;
+            }
+#endif
+
+        private:
+            // The high 64 bits of a * b; the low 64 bits go to `low`.
+            static const unsigned long long multiply(const unsigned long long &a, const unsigned long long &b, unsigned long long &low)
+            {
+#ifdef __SIZEOF_INT128__
+                const unsigned __int128 product = (unsigned __int128)a * b;
+                low = (unsigned long long)product;
+                return (unsigned long long)(product >> 64);
+#else
+                const unsigned long long a_lo = a & 0xffffffffULL, a_hi = a >> 32;
+                const unsigned long long b_lo = b & 0xffffffffULL, b_hi = b >> 32;
+                const unsigned long long lo_lo = a_lo * b_lo;
+                const unsigned long long hi_lo = a_hi * b_lo;
+                const unsigned long long lo_hi = a_lo * b_hi;
+                const unsigned long long middle = (lo_lo >> 32) + (hi_lo & 0xffffffffULL) + lo_hi;
+                low = (middle << 32) | (lo_lo & 0xffffffffULL);
+                return a_hi * b_hi + (hi_lo >> 32) + (middle >> 32);
 #endif
+            }
+    };
+
     class RandomIterator
     {
         public:
@@ -107,9 +787,9 @@ namespace lazycp
                 if (num_left > 0)
                 {
                     uint1024_t range_size((n - last_k) / num_left);
-                    uniform_int_distribution<uint1024_t> rnd(0, range_size);
-                    uint1024_t r(rnd(gen) + last_k + 1);
-                    last_k.assign(r);
+                    uint1024_t r(bounded_random::below(gen, range_size) + last_k);
+                    LCP_COUNT(rng_draws, 1);
+                    last_k.assign(r + 1);
                     num_left--;
                     return r;
                 }
@@ -138,9 +818,9 @@ namespace lazycp
                 if (num_left > 0)
                 {
                     unsigned long long range_size = (n - last_k) / num_left;
-                    uniform_int_distribution<> rnd(0, range_size);
-                    unsigned long long r = rnd(gen) + last_k + 1;
-                    last_k = r;
+                    unsigned long long r = bounded_random::below(gen, range_size) + last_k;
+                    LCP_COUNT(rng_draws, 1);
+                    last_k = r + 1;
                     num_left--;
                     return r;
                 }
@@ -154,6 +834,20 @@ namespace lazycp
             {
                 return num_left > 0;
             }
+            // Serializes the remaining count, the next candidate index and the generator
+            // so a sample can be resumed exactly where it stopped. The trailing
+            // space keeps Boost.Random's reader from failing at end of input.
+            void save(ostream &out) const
+            {
+                out << n << " " << last_k << " " << num_left << " " << gen << " ";
+            }
+            void load(istream &in)
+            {
+                if (!(in >> n >> last_k >> num_left >> gen))
+                {
+                    throw errors::invalid_checkpoint_error();
+                }
+            }
 
         private:
 #ifdef USE_BOOST
@@ -168,105 +862,602 @@ namespace lazycp
             mt19937_64         gen;
     };
 
-    class lazy_cartesian_product
+    // How a sample's indices are drawn. sequential_skip is RandomIterator:
+    // constant memory and ascending, but not uniform over all subsets. floyd
+    // (Floyd's subset algorithm) and complement (floyd on the rows left out,
+    // then a scan) draw exactly uniform subsets in ascending order.
+    // permutation_prefix is a sparse Fisher-Yates shuffle and yields the rows
+    // in random order.
+    enum class sampling_strategy
     {
-        public:
-#ifdef USE_BOOST
-            static const vector<string> boost_entry_at(const vector<vector<string>> &combinations, const string &index)
+        sequential_skip,
+        floyd,
+        complement,
+        permutation_prefix
+    };
+
+    enum class sample_order
+    {
+        ascending,
+        shuffled
+    };
+
+    struct sampling_plan
+    {
+        sampling_strategy  strategy;
+        sample_order       order;
+        index_type         population;
+        index_type         sample_size;
+        bool               wide;
+        long double        estimated_cost;
+        long double        estimated_bytes;
+        string             reason;
+
+        // One line naming the strategy and why it was chosen. Costs are in
+        // units of one row decode.
+        const string explain(void) const
+        {
+            static const char *names[] = {"sequential_skip", "floyd", "complement", "permutation_prefix"};
+            std::ostringstream out;
+            out << names[(int)strategy] << ": " << sample_size << " of " << population << " rows, "
+                << (order == sample_order::ascending ? "ascending" : "shuffled") << ", "
+                << (wide ? "multi-limb" : "64-bit") << " indices, est. cost " << (double)estimated_cost
+                << " row decodes, est. memory " << (double)estimated_bytes << " bytes; " << reason;
+            return out.str();
+        }
+    };
+
+    // Picks the cheapest sampling algorithm that gives a uniform sample in
+    // the requested order within the memory budget, and draws with it.
+    class sampler
+    {
+        public:
+            static const sampling_plan plan(const index_type &population, const index_type &sample_size, const sample_order &order = sample_order::ascending, const unsigned long long &budget = LCP_MEMORY_BUDGET)
             {
-                const precomputed_stats pc = boost_precompute(combinations);
-                uint1024_t parsed_index(index);
-                if (parsed_index  < 0 || parsed_index >= pc.max_size)
+                if (sample_size > population)
                 {
-                    throw errors::index_error();
+                    throw errors::invalid_sample_size_error();
                 }
 
-                const vector<string> combination = boost_entry_at(combinations, parsed_index, pc);
-                return combination;
+                sampling_plan result;
+                result.order = order;
+                result.population = population;
+                result.sample_size = sample_size;
+#ifdef USE_BOOST
+                result.wide = population > 0 && msb(population) >= 64;
+                const long double n = population.convert_to<long double>();
+                const long double k = sample_size.convert_to<long double>();
+#else
+                result.wide = false;
+                const long double n = population;
+                const long double k = sample_size;
+#endif
+                // Drawing and comparing multi-limb indices costs several
+                // times more than 64-bit ones.
+                const long double scale = result.wide ? 8 : 1;
+                const long double draw = 0.1 * scale;
+                const long double scan = 0.02;
+                const long double node = sizeof(index_type) + 6 * sizeof(void *);
+                const long double decode = k;
+
+                const long double skip_cost = decode + k * draw;
+                const long double floyd_cost = decode + k * (draw + set_cost(k, scale));
+                const long double complement_cost = decode + (n - k) * (draw + set_cost(n - k, scale)) + n * scan;
+                const long double floyd_bytes = k * node;
+                const long double complement_bytes = (n - k) * node;
+
+                if (order == sample_order::shuffled)
+                {
+                    result.strategy = sampling_strategy::permutation_prefix;
+                    result.estimated_cost = decode + k * (draw + 2 * set_cost(k, scale));
+                    result.estimated_bytes = k * (node + sizeof(index_type));
+                    result.reason = "the only strategy that yields a random order";
+                }
+                else if (floyd_bytes > budget && complement_bytes > budget)
+                {
+                    result.strategy = sampling_strategy::sequential_skip;
+                    result.estimated_cost = skip_cost;
+                    result.estimated_bytes = 0;
+                    result.reason = "the exact strategies exceed the memory budget, so the sample is not uniform over subsets";
+                }
+                else if (complement_bytes <= budget && (floyd_bytes > budget || complement_cost < floyd_cost))
+                {
+                    result.strategy = sampling_strategy::complement;
+                    result.estimated_cost = complement_cost;
+                    result.estimated_bytes = complement_bytes;
+                    result.reason = "most rows are sampled, so drawing the excluded ones is cheaper";
+                }
+                else
+                {
+                    result.strategy = sampling_strategy::floyd;
+                    result.estimated_cost = floyd_cost;
+                    result.estimated_bytes = floyd_bytes;
+                    result.reason = "a small fraction of rows is sampled";
+                }
+                return result;
             }
-            static const vector<vector<string>> boost_generate_samples(const vector<vector<string>> combinations, const string &sample_size)
+
+            // Calls `fn(index)` for every sampled index, in the plan's order.
+            template <class Function>
+            static void draw(const sampling_plan &plan, Function fn)
             {
-                const uint1024_t parsed_sample_size(sample_size);
-                if (combinations.size() == 0)
+                if (plan.strategy == sampling_strategy::sequential_skip)
                 {
-                    throw errors::empty_list_error();
+                    RandomIterator iter(plan.sample_size, plan.population);
+                    while (iter.has_next())
+                    {
+                        fn(iter.next());
+                    }
+                    return;
                 }
-                precomputed_stats ps = boost_precompute(combinations);
 
-                vector<vector<string>> subset;
-                if (parsed_sample_size != ps.max_size)
+                random_device device;
+                batch_random gen(((unsigned long long)device() << 32) ^ device());
+                if (plan.strategy == sampling_strategy::floyd)
+                {
+                    for (const index_type &index: floyd(plan.population, plan.sample_size, gen))
+                    {
+                        fn(index);
+                    }
+                }
+                else if (plan.strategy == sampling_strategy::complement)
                 {
-                    RandomIterator iter(parsed_sample_size, ps.max_size);
-                    while(iter.has_next())
+                    const std::set<index_type> excluded = floyd(plan.population, plan.population - plan.sample_size, gen);
+                    std::set<index_type>::const_iterator skip = excluded.begin();
+                    for (index_type index = 0; index < plan.population; ++index)
                     {
-                        subset.push_back(boost_entry_at(combinations, iter.next(), ps));
+                        if (skip != excluded.end() && *skip == index)
+                        {
+                            ++skip;
+                            continue;
+                        }
+                        fn(index);
                     }
                 }
                 else
                 {
-                    for (uint1024_t i = 0; i < parsed_sample_size; ++i)
+                    // Position i of a virtual array holding 0..population-1;
+                    // only the swapped positions are stored.
+                    std::map<index_type, index_type> moved;
+                    for (index_type i = 0; i < plan.sample_size; ++i)
                     {
-                        subset.push_back(boost_entry_at(combinations, i, ps));
+                        const index_type j = i + bounded_random::below(gen, index_type(plan.population - i));
+                        LCP_COUNT(rng_draws, 1);
+                        std::map<index_type, index_type>::iterator at_j = moved.find(j);
+                        const index_type chosen = at_j == moved.end() ? j : at_j->second;
+                        std::map<index_type, index_type>::iterator at_i = moved.find(i);
+                        moved[j] = at_i == moved.end() ? i : at_i->second;
+                        if (at_i != moved.end())
+                        {
+                            moved.erase(at_i);
+                        }
+                        fn(chosen);
                     }
                 }
+            }
 
-                return subset;
+        private:
+            static const long double set_cost(const long double &size, const long double &scale)
+            {
+                return 0.02 * scale * std::log2(size + 2);
             }
-            static const uint1024_t boost_compute_max_size(const vector<vector<string>> &combinations)
+            // Floyd's algorithm: a uniformly random `count`-subset of
+            // [0, population) with `count` draws.
+            static const std::set<index_type> floyd(const index_type &population, const index_type &count, batch_random &gen)
             {
-                uint1024_t size(1);
-                for (vector<vector<string>>::const_iterator it = combinations.begin(); it != combinations.end(); ++it)
+                std::set<index_type> chosen;
+                for (index_type j = population - count; j < population; ++j)
                 {
-                    size *= (*it).size();
+                    const index_type t = bounded_random::below(gen, index_type(j + 1));
+                    LCP_COUNT(rng_draws, 1);
+                    if (!chosen.insert(t).second)
+                    {
+                        chosen.insert(j);
+                    }
                 }
+                return chosen;
+            }
+    };
 
-                return size;
+    // A monotonic allocator: memory comes from large blocks by bumping a
+    // pointer and is only returned, all at once, by release() or the
+    // destructor. With `huge_pages` the blocks are mapped in 2 MiB multiples
+    // and advised as transparent huge pages where the system supports it.
+    class arena
+    {
+        public:
+            explicit arena(const unsigned long long &block_size = LCP_ARENA_BLOCK_SIZE, const bool &huge_pages = false): block_size(block_size), huge_pages(huge_pages), top(0), end(0), reserved(0) {}
+            arena(const arena &) = delete;
+            arena &operator=(const arena &) = delete;
+            ~arena()
+            {
+                release();
             }
-            
-#else
-            static const vector<string> entry_at(const vector<vector<string>> &combinations, const unsigned long long &index)
+
+            void *allocate(const unsigned long long &bytes, const unsigned long long &alignment)
             {
-                const precomputed_stats pc = precompute(combinations);
-                if (index  < 0 || index >= pc.max_size)
+                char *start = align(top, alignment);
+                if (!top || bytes > (unsigned long long)(end - start))
                 {
-                    throw errors::index_error();
+                    grow(bytes + alignment);
+                    start = align(top, alignment);
+                }
+                top = start + bytes;
+                return start;
+            }
+            // Only the most recent allocation is given back; anything else
+            // waits for release().
+            void deallocate(void *pointer, const unsigned long long &bytes)
+            {
+                if ((char *)pointer + bytes == top)
+                {
+                    top = (char *)pointer;
+                }
+            }
+            void release(void)
+            {
+                for (const region &block: blocks)
+                {
+#ifdef LCP_HAS_MMAP
+                    if (block.mapped)
+                    {
+                        munmap(block.base, block.size);
+                        continue;
+                    }
+#endif
+                    delete[] block.base;
                 }
+                blocks.clear();
+                top = end = 0;
+                reserved = 0;
+            }
+            const unsigned long long bytes_reserved(void) const
+            {
+                return reserved;
+            }
 
-                const vector<string> combination = entry_at(combinations, index, pc);
-                return combination;
+        private:
+            struct region
+            {
+                char               *base;
+                unsigned long long size;
+                bool               mapped;
+            };
+
+            static char *align(char *pointer, const unsigned long long &alignment)
+            {
+                return (char *)(((std::uintptr_t)pointer + alignment - 1) & ~(std::uintptr_t)(alignment - 1));
             }
-            static const vector<vector<string>> generate_samples(const vector<vector<string>> combinations, const unsigned long long &sample_size)
+            void grow(const unsigned long long &minimum)
             {
-                if (combinations.size() == 0)
+                region block;
+                block.size = minimum > block_size ? minimum : block_size;
+                block.mapped = false;
+#ifdef LCP_HAS_MMAP
+                if (huge_pages)
                 {
-                    throw errors::empty_list_error();
+                    const unsigned long long huge_page = 2 * 1024 * 1024;
+                    block.size = (block.size + huge_page - 1) / huge_page * huge_page;
+                    void *mapping = mmap(0, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if (mapping == MAP_FAILED)
+                    {
+                        throw std::bad_alloc();
+                    }
+#ifdef MADV_HUGEPAGE
+                    madvise(mapping, block.size, MADV_HUGEPAGE);
+#endif
+                    block.base = (char *)mapping;
+                    block.mapped = true;
+                }
+#endif
+                if (!block.mapped)
+                {
+                    block.base = new char[block.size];
                 }
-                precomputed_stats ps = precompute(combinations);
+                blocks.push_back(block);
+                top = block.base;
+                end = block.base + block.size;
+                reserved += block.size;
+            }
 
-                vector<vector<string>> subset;
-                if (sample_size != ps.max_size)
+            const unsigned long long block_size;
+            const bool               huge_pages;
+            char                     *top;
+            char                     *end;
+            unsigned long long       reserved;
+            vector<region>           blocks;
+    };
+
+    // Allocates from an arena, so containers using it are freed together
+    // when the arena is released.
+    template <class T>
+    class arena_allocator
+    {
+        public:
+            typedef T value_type;
+
+            arena_allocator(arena &source): source(&source) {}
+            template <class U>
+            arena_allocator(const arena_allocator<U> &other): source(other.source) {}
+
+            T *allocate(const std::size_t n)
+            {
+                return (T *)source->allocate(n * sizeof(T), alignof(T));
+            }
+            void deallocate(T *pointer, const std::size_t n)
+            {
+                source->deallocate(pointer, n * sizeof(T));
+            }
+            template <class U>
+            const bool operator==(const arena_allocator<U> &other) const
+            {
+                return source == other.source;
+            }
+            template <class U>
+            const bool operator!=(const arena_allocator<U> &other) const
+            {
+                return source != other.source;
+            }
+
+        private:
+            template <class U> friend class arena_allocator;
+
+            arena *source;
+    };
+
+    typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+    typedef vector<arena_string, arena_allocator<arena_string>> arena_row;
+    typedef vector<arena_row, arena_allocator<arena_row>> arena_rows;
+
+    // Sampled rows that all live in one arena: filling it makes no
+    // individual heap allocations, and clear() or the destructor frees every
+    // row at once. Fill it with generate_samples_into(..., batch.rows).
+    struct sample_batch
+    {
+        explicit sample_batch(const bool &huge_pages = false): memory(LCP_ARENA_BLOCK_SIZE, huge_pages), rows(arena_allocator<arena_row>(memory)) {}
+
+        void clear(void)
+        {
+            arena_rows(arena_allocator<arena_row>(memory)).swap(rows);
+            memory.release();
+        }
+
+        arena      memory;
+        arena_rows rows;
+    };
+
+    // A non-owning reference to characters: a std::string, a string with a
+    // custom allocator (such as arena_string), a C string or a pointer and a
+    // length. The characters must outlive it.
+    struct string_ref
+    {
+        string_ref(): data(0), size(0) {}
+        string_ref(const char *text): data(text), size(std::strlen(text)) {}
+        string_ref(const char *data, const std::size_t &size): data(data), size(size) {}
+        template <class String, class = decltype(std::declval<const String &>().data() + std::declval<const String &>().size())>
+        string_ref(const String &text): data(text.data()), size(text.size()) {}
+
+        const string str(void) const
+        {
+            return string(data, size);
+        }
+        const bool operator==(const string_ref &other) const
+        {
+            return size == other.size && std::memcmp(data, other.data, size) == 0;
+        }
+        const bool operator!=(const string_ref &other) const
+        {
+            return !(*this == other);
+        }
+
+        const char  *data;
+        std::size_t size;
+    };
+
+    // Decodes and samples rows of a spec held in any random-access range of
+    // random-access ranges whose values convert to string_ref (vectors or
+    // arrays of std::string, const char * or arena_string, among others)
+    // without copying it. Rows are returned as string_refs into the spec,
+    // which must outlive the view. Build one with make_product_view(spec).
+    template <class Spec>
+    class product_view
+    {
+        public:
+            explicit product_view(const Spec &spec): spec(&spec)
+            {
+                const unsigned long long dimensions = std::end(spec) - std::begin(spec);
+                if (dimensions == 0)
+                {
+                    throw errors::empty_answers_error();
+                }
+                sizes.resize(dimensions);
+                divs.resize(dimensions);
+                index_type factor = 1;
+                for (long long d = dimensions - 1; d >= 0; --d)
+                {
+                    sizes[d] = std::end(dimension(d)) - std::begin(dimension(d));
+                    divs[d] = factor;
+                    factor *= sizes[d];
+                }
+                total = factor;
+            }
+            // The spec is referenced, so temporaries are refused.
+            explicit product_view(const Spec &&spec) = delete;
+
+            const index_type &max_size(void) const
+            {
+                return total;
+            }
+            const unsigned long long dimensions(void) const
+            {
+                return sizes.size();
+            }
+            const vector<unsigned long long> indices_at(const index_type &index) const
+            {
+                if (index >= total)
+                {
+                    throw errors::index_error();
+                }
+                vector<unsigned long long> digits(sizes.size());
+                for (unsigned long long d = 0; d < sizes.size(); ++d)
+                {
+                    digits[d] = (unsigned long long)((index / divs[d]) % sizes[d]);
+                }
+                return digits;
+            }
+            const vector<string_ref> entry_at(const index_type &index) const
+            {
+                const vector<unsigned long long> digits = indices_at(index);
+                vector<string_ref> row(digits.size());
+                for (unsigned long long d = 0; d < digits.size(); ++d)
+                {
+                    row[d] = value(d, digits[d]);
+                }
+                return row;
+            }
+            // Calls `fn(row)` for every combination in [first, last).
+            template <class Function>
+            void for_each(const index_type &first, const index_type &last, Function fn) const
+            {
+                if (first >= last)
+                {
+                    return;
+                }
+                if (last > total)
+                {
+                    throw errors::index_error();
+                }
+                vector<unsigned long long> digits = indices_at(first);
+                vector<string_ref> row(digits.size());
+                for (unsigned long long d = 0; d < digits.size(); ++d)
+                {
+                    row[d] = value(d, digits[d]);
+                }
+                for (index_type i = first; i < last; ++i)
                 {
-		    subset.reserve(sample_size);
-                    RandomIterator iter(sample_size, ps.max_size);
-                    while(iter.has_next())
+                    fn((const vector<string_ref> &)row);
+                    for (long long d = digits.size() - 1; d >= 0; --d)
                     {
-                        subset.push_back(entry_at(combinations, iter.next(), ps));
+                        if (++digits[d] < sizes[d])
+                        {
+                            row[d] = value(d, digits[d]);
+                            break;
+                        }
+                        digits[d] = 0;
+                        row[d] = value(d, 0);
                     }
                 }
-                else
+            }
+            // Calls `fn(row)` for a random sample, drawn by the sampler.
+            template <class Function>
+            void sample(const index_type &sample_size, Function fn, const sample_order &order = sample_order::ascending) const
+            {
+                vector<string_ref> row(sizes.size());
+                sampler::draw(sampler::plan(total, sample_size, order), [&](const index_type &index)
                 {
-		    subset.reserve(sample_size);
-                    for (unsigned long long i = 0; i < sample_size; ++i)
+                    for (unsigned long long d = 0; d < sizes.size(); ++d)
                     {
-                        subset.push_back(entry_at(combinations, i, ps));
+                        row[d] = value(d, (unsigned long long)((index / divs[d]) % sizes[d]));
                     }
+                    fn((const vector<string_ref> &)row);
+                });
+            }
+
+        private:
+            auto dimension(const unsigned long long &d) const -> decltype(*std::begin(std::declval<const Spec &>()))
+            {
+                return *(std::begin(*spec) + d);
+            }
+            const string_ref value(const unsigned long long &d, const unsigned long long &k) const
+            {
+                return string_ref(*(std::begin(dimension(d)) + k));
+            }
+
+            const Spec                 *spec;
+            vector<unsigned long long> sizes;
+            vector<index_type>         divs;
+            index_type                 total;
+    };
+
+    template <class Spec>
+    const product_view<Spec> make_product_view(const Spec &spec)
+    {
+        return product_view<Spec>(spec);
+    }
+    template <class Spec>
+    const product_view<Spec> make_product_view(const Spec &&spec) = delete;
+
+    struct memory_plan
+    {
+        index_type         rows;
+        long double        row_bytes;
+        long double        estimated_bytes;
+        unsigned long long budget;
+        bool               streaming;
+    };
+
+    class lazy_cartesian_product
+    {
+        public:
+#ifdef USE_BOOST
+            static const vector<string> boost_entry_at(const vector<vector<string>> &combinations, const string &index)
+            {
+                const precomputed_stats pc = boost_precompute(combinations);
+                uint1024_t parsed_index(index);
+                if (parsed_index  < 0 || parsed_index >= pc.max_size)
+                {
+                    throw errors::index_error();
+                }
+
+                const vector<string> combination = boost_entry_at(combinations, parsed_index, pc);
+                return combination;
+            }
+            // Throws memory_budget_error rather than materializing a sample
+            // that estimate_memory puts over `budget`.
+            static const vector<vector<string>> boost_generate_samples(const vector<vector<string>> &combinations, const string &sample_size, progress_monitor *progress = 0, const unsigned long long &budget = LCP_MEMORY_BUDGET)
+            {
+                const uint1024_t parsed_sample_size(sample_size);
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_list_error();
+                }
+                precomputed_stats ps = boost_precompute(combinations, LCP_FUSION_LIMIT);
+
+                const sampling_plan plan = sampler::plan(ps.max_size, parsed_sample_size);
+                if (estimate_memory(combinations, plan.sample_size, budget).streaming)
+                {
+                    throw errors::memory_budget_error();
                 }
+                vector<vector<string>> subset;
+                progress_batch batch(progress);
+                sampler::draw(plan, [&](const uint1024_t &index)
+                {
+                    append_row(subset, boost_entry_at(combinations, index, ps));
+                    batch.add_row();
+                });
 
                 return subset;
             }
-            static const unsigned long long compute_max_size(const vector<vector<string>> &combinations)
+            template <class Rows>
+            static void boost_generate_samples_into(const vector<vector<string>> &combinations, const string &sample_size, Rows &rows, progress_monitor *progress = 0)
             {
-                unsigned long long size = 1;
+                const uint1024_t parsed_sample_size(sample_size);
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_list_error();
+                }
+                precomputed_stats ps = boost_precompute(combinations, LCP_FUSION_LIMIT);
+
+                progress_batch batch(progress);
+                sampler::draw(sampler::plan(ps.max_size, parsed_sample_size), [&](const uint1024_t &index)
+                {
+                    append_row_into(combinations, index, ps, rows);
+                    batch.add_row();
+                });
+            }
+            static const uint1024_t boost_compute_max_size(const vector<vector<string>> &combinations)
+            {
+                uint1024_t size(1);
                 for (vector<vector<string>>::const_iterator it = combinations.begin(); it != combinations.end(); ++it)
                 {
                     size *= (*it).size();
@@ -274,11 +1465,9 @@ namespace lazycp
 
                 return size;
             }
-#endif
-        private:
-#ifdef USE_BOOST
-            static const precomputed_stats boost_precompute(const vector<vector<string>> &combinations)
+            static const precomputed_stats boost_precompute(const vector<vector<string>> &combinations, const unsigned long long &fusion_limit = 0)
             {
+                LCP_TIMER(timer);
                 precomputed_stats ps;
                 if (combinations.size() == 0)
                 {
@@ -299,68 +1488,3078 @@ namespace lazycp
                 }
 
                 ps.max_size = boost_compute_max_size(combinations);
+                fuse_dimensions(combinations, ps, fusion_limit);
+                LCP_TIME(timer, precompute_ns);
                 return ps;
             }
-            static const bool boost_sample_size_valid(const uint1024_t &sample, const uint1024_t &max_size)
-            {
-                return sample <= max_size;
-            }
-
             static const vector<string> boost_entry_at(const vector<vector<string>> &combinations, const uint1024_t &n, const precomputed_stats &ps)
             {
                 unsigned long long length(combinations.size());
+                LCP_TIMER(timer);
                 vector<string> combination(length);
 
-                for (unsigned long long i = 0; i < length; ++i)
+                for (const fused_group &group: ps.groups)
                 {
-                    combination[i] = combinations[i][(unsigned long long)((uint1024_t)(n / ps.divs[i]) % ps.mods[i])];
+                    store_digit(combinations, group, decode_digit(n, group), combination);
                 }
 
+                LCP_COUNT(rows_decoded, 1);
+                LCP_COUNT(allocations, 1 + heap_strings(combination));
+                LCP_TIME(timer, decode_ns);
                 return combination;
             }
-#else
-            static const precomputed_stats precompute(const vector<vector<string>> &combinations)
+            static const vector<unsigned long long> boost_indices_at(const vector<vector<string>> &combinations, const uint1024_t &n, const precomputed_stats &ps)
             {
-                precomputed_stats ps;
-                if (combinations.size() == 0)
-                {
-                    throw errors::empty_answers_error();
-                }
-
-                unsigned long long size = combinations.size();
-                ps.divs.resize(size);
-                ps.mods.resize(size);
-                unsigned long factor = 1;
+                vector<unsigned long long> digits(combinations.size());
 
-                for (long long i = size - 1; i >= 0; --i)
+                for (const fused_group &group: ps.groups)
                 {
-                    unsigned long long items = combinations[i].size();
-                    ps.divs[i] = factor;
-                    ps.mods[i] = items;
-                    factor *= items;
+                    unsigned long long digit = decode_digit(n, group);
+                    if (group.count == 1)
+                    {
+                        digits[group.first] = digit;
+                        continue;
+                    }
+                    for (unsigned long long k = 0; k < group.count; ++k)
+                    {
+                        digits[group.first + k] = group.digits[digit * group.count + k];
+                    }
                 }
 
-                ps.max_size = compute_max_size(combinations);
-                return ps;
+                return digits;
             }
-            static const bool sample_size_valid(const unsigned long long &sample, const unsigned long &max_size)
+            
+#else
+            static const vector<string> entry_at(const vector<vector<string>> &combinations, const unsigned long long &index)
             {
-                return sample <= max_size;
+                const precomputed_stats pc = precompute(combinations);
+                if (index  < 0 || index >= pc.max_size)
+                {
+                    throw errors::index_error();
+                }
+
+                const vector<string> combination = entry_at(combinations, index, pc);
+                return combination;
+            }
+            // Throws memory_budget_error rather than materializing a sample
+            // that estimate_memory puts over `budget`; sample_set streams
+            // such samples instead.
+            static const vector<vector<string>> generate_samples(const vector<vector<string>> &combinations, const unsigned long long &sample_size, progress_monitor *progress = 0, const unsigned long long &budget = LCP_MEMORY_BUDGET)
+            {
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_list_error();
+                }
+                precomputed_stats ps = precompute(combinations, LCP_FUSION_LIMIT);
+
+                const sampling_plan plan = sampler::plan(ps.max_size, sample_size);
+                if (estimate_memory(combinations, plan.sample_size, budget).streaming)
+                {
+                    throw errors::memory_budget_error();
+                }
+                vector<vector<string>> subset;
+		subset.reserve(sample_size);
+                progress_batch batch(progress);
+                sampler::draw(plan, [&](const unsigned long long &index)
+                {
+                    append_row(subset, entry_at(combinations, index, ps));
+                    batch.add_row();
+                });
+
+                return subset;
+            }
+            // Appends a sample, drawn as generate_samples draws it, to any
+            // vector-like container of rows, using the container's allocator
+            // for the rows and their values (e.g. arena_rows).
+            template <class Rows>
+            static void generate_samples_into(const vector<vector<string>> &combinations, const unsigned long long &sample_size, Rows &rows, progress_monitor *progress = 0)
+            {
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_list_error();
+                }
+                precomputed_stats ps = precompute(combinations, LCP_FUSION_LIMIT);
+
+                const sampling_plan plan = sampler::plan(ps.max_size, sample_size);
+                rows.reserve(rows.size() + sample_size);
+                progress_batch batch(progress);
+                sampler::draw(plan, [&](const unsigned long long &index)
+                {
+                    append_row_into(combinations, index, ps, rows);
+                    batch.add_row();
+                });
+            }
+            static const unsigned long long compute_max_size(const vector<vector<string>> &combinations)
+            {
+                unsigned long long size = 1;
+                for (vector<vector<string>>::const_iterator it = combinations.begin(); it != combinations.end(); ++it)
+                {
+                    size *= (*it).size();
+                }
+
+                return size;
+            }
+            static const precomputed_stats precompute(const vector<vector<string>> &combinations, const unsigned long long &fusion_limit = 0)
+            {
+                LCP_TIMER(timer);
+                precomputed_stats ps;
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_answers_error();
+                }
+
+                unsigned long long size = combinations.size();
+                ps.divs.resize(size);
+                ps.mods.resize(size);
+                unsigned long factor = 1;
+
+                for (long long i = size - 1; i >= 0; --i)
+                {
+                    unsigned long long items = combinations[i].size();
+                    ps.divs[i] = factor;
+                    ps.mods[i] = items;
+                    factor *= items;
+                }
+
+                ps.max_size = compute_max_size(combinations);
+                fuse_dimensions(combinations, ps, fusion_limit);
+                LCP_TIME(timer, precompute_ns);
+                return ps;
             }
             static const vector<string> entry_at(const vector<vector<string>> &combinations, const unsigned long long &n, const precomputed_stats &ps)
             {
                 unsigned long long length = combinations.size();
+                LCP_TIMER(timer);
                 vector<string> combination(length);
 
-                for (unsigned long long i = 0; i < length; ++i)
+                for (const fused_group &group: ps.groups)
                 {
-                    combination[i] = combinations[i][(unsigned long long)(floor(n / ps.divs[i])) % ps.mods[i]];
+                    store_digit(combinations, group, decode_digit(n, group), combination);
                 }
 
+                LCP_COUNT(rows_decoded, 1);
+                LCP_COUNT(allocations, 1 + heap_strings(combination));
+                LCP_TIME(timer, decode_ns);
                 return combination;
             }
+            static const vector<unsigned long long> indices_at(const vector<vector<string>> &combinations, const unsigned long long &n, const precomputed_stats &ps)
+            {
+                vector<unsigned long long> digits(combinations.size());
+
+                for (const fused_group &group: ps.groups)
+                {
+                    unsigned long long digit = decode_digit(n, group);
+                    if (group.count == 1)
+                    {
+                        digits[group.first] = digit;
+                        continue;
+                    }
+                    for (unsigned long long k = 0; k < group.count; ++k)
+                    {
+                        digits[group.first + k] = group.digits[digit * group.count + k];
+                    }
+                }
+
+                return digits;
+            }
+#endif
+            // Estimates the memory a vector<vector<string>> holding
+            // `sample_size` rows of `combinations` takes: the row vectors,
+            // their strings, and the heap buffers of values too long for the
+            // small string buffer, each with allocator overhead. `streaming`
+            // is set when the estimate exceeds `budget`.
+            static const memory_plan estimate_memory(const vector<vector<string>> &combinations, const index_type &sample_size, const unsigned long long &budget = LCP_MEMORY_BUDGET)
+            {
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_list_error();
+                }
+
+                const unsigned long long inline_capacity = string().capacity();
+                const long double overhead = 2 * sizeof(void *);
+                long double row_bytes = sizeof(vector<string>) + overhead + combinations.size() * sizeof(string);
+                for (const vector<string> &values: combinations)
+                {
+                    if (values.size() == 0)
+                    {
+                        throw errors::empty_answers_error();
+                    }
+                    long double heap = 0;
+                    for (const string &value: values)
+                    {
+                        if (value.size() > inline_capacity)
+                        {
+                            heap += value.size() + 1 + overhead;
+                        }
+                    }
+                    row_bytes += heap / values.size();
+                }
+
+                memory_plan plan;
+                plan.rows = sample_size;
+                plan.row_bytes = row_bytes;
+#ifdef USE_BOOST
+                plan.estimated_bytes = sample_size.convert_to<long double>() * row_bytes;
+#else
+                plan.estimated_bytes = (long double)sample_size * row_bytes;
+#endif
+                plan.budget = budget;
+                plan.streaming = plan.estimated_bytes > budget;
+                return plan;
+            }
+            // Writes every combination, in index order, as delimiter-separated
+            // lines. The innermost dimensions whose rendered rows fit within
+            // LCP_SUFFIX_BLOCK_SIZE bytes are rendered once into a block, and each
+            // row is emitted as the outer prefix followed by a copy of a block row.
+            static void write_all(const vector<vector<string>> &combinations, ostream &out, const string &delimiter = ",", progress_monitor *progress = 0)
+            {
+                if (combinations.size() == 0)
+                {
+                    throw errors::empty_list_error();
+                }
+                for (const vector<string> &values: combinations)
+                {
+                    if (values.size() == 0)
+                    {
+                        return;
+                    }
+                }
+
+                unsigned long long length = combinations.size();
+                unsigned long long split = length;
+                string block("\n");
+                vector<unsigned long long> offsets = { 0, 1 };
+
+                while (split > 0)
+                {
+                    const vector<string> &values = combinations[split - 1];
+                    unsigned long long rows = offsets.size() - 1;
+                    unsigned long long value_bytes = 0;
+                    for (const string &value: values)
+                    {
+                        value_bytes += value.size();
+                    }
+                    unsigned long long separator = split < length ? delimiter.size() : 0;
+                    unsigned long long bytes = values.size() * (block.size() + rows * separator) + rows * value_bytes;
+                    if (split < length && bytes > LCP_SUFFIX_BLOCK_SIZE)
+                    {
+                        break;
+                    }
+
+                    string next_block;
+                    vector<unsigned long long> next_offsets(1, 0);
+                    next_block.reserve(bytes);
+                    next_offsets.reserve(values.size() * rows + 1);
+                    for (const string &value: values)
+                    {
+                        for (unsigned long long r = 0; r < rows; ++r)
+                        {
+                            next_block.append(value);
+                            if (separator > 0)
+                            {
+                                next_block.append(delimiter);
+                            }
+                            next_block.append(block, offsets[r], offsets[r + 1] - offsets[r]);
+                            next_offsets.push_back(next_block.size());
+                        }
+                    }
+                    block.swap(next_block);
+                    offsets.swap(next_offsets);
+                    --split;
+                }
+
+                if (split == 0)
+                {
+                    LCP_COUNT(rows_decoded, offsets.size() - 1);
+                    LCP_TIMER(output_timer);
+                    out.write(block.data(), block.size());
+                    LCP_TIME(output_timer, output_ns);
+                    if (progress)
+                    {
+                        progress->add(offsets.size() - 1);
+                    }
+                    return;
+                }
+
+                string buffer;
+                buffer.reserve(LCP_OUTPUT_BUFFER_SIZE + block.size());
+                vector<unsigned long long> digits(split, 0);
+                string prefix;
+                bool done = false;
+                while (!done)
+                {
+                    prefix.clear();
+                    for (unsigned long long i = 0; i < split; ++i)
+                    {
+                        prefix.append(combinations[i][digits[i]]);
+                        prefix.append(delimiter);
+                    }
+                    LCP_TIMER(copy_timer);
+                    for (unsigned long long r = 0; r + 1 < offsets.size(); ++r)
+                    {
+                        buffer.append(prefix);
+                        buffer.append(block, offsets[r], offsets[r + 1] - offsets[r]);
+                    }
+                    LCP_TIME(copy_timer, copy_ns);
+                    LCP_COUNT(rows_decoded, offsets.size() - 1);
+                    LCP_COUNT(bytes_copied, (offsets.size() - 1) * prefix.size() + block.size());
+                    if (buffer.size() >= LCP_OUTPUT_BUFFER_SIZE)
+                    {
+                        LCP_TIMER(output_timer);
+                        out.write(buffer.data(), buffer.size());
+                        LCP_TIME(output_timer, output_ns);
+                        buffer.clear();
+                    }
+                    if (progress)
+                    {
+                        progress->add(offsets.size() - 1);
+                    }
+
+                    done = true;
+                    for (long long i = split - 1; i >= 0; --i)
+                    {
+                        if (++digits[i] < combinations[i].size())
+                        {
+                            done = false;
+                            break;
+                        }
+                        digits[i] = 0;
+                    }
+                }
+                LCP_TIMER(output_timer);
+                out.write(buffer.data(), buffer.size());
+                LCP_TIME(output_timer, output_ns);
+            }
+        private:
+#ifdef USE_BOOST
+            static const bool boost_sample_size_valid(const uint1024_t &sample, const uint1024_t &max_size)
+            {
+                return sample <= max_size;
+            }
+
+#else
+            static const bool sample_size_valid(const unsigned long long &sample, const unsigned long &max_size)
+            {
+                return sample <= max_size;
+            }
+#endif
+            // Groups adjacent dimensions, innermost first, while their combined
+            // size stays within `fusion_limit` rows. A limit of 0 (or 1) leaves
+            // every dimension in a group of its own.
+            static void fuse_dimensions(const vector<vector<string>> &combinations, precomputed_stats &ps, const unsigned long long &fusion_limit)
+            {
+                unsigned long long limit = fusion_limit > 65536 ? 65536 : fusion_limit;
+                long long i = combinations.size() - 1;
+                ps.groups.clear();
+
+                while (i >= 0)
+                {
+                    unsigned long long product = combinations[i].size();
+                    long long first = i;
+                    while (first > 0 && product > 0 && combinations[first - 1].size() > 0 && product * combinations[first - 1].size() <= limit)
+                    {
+                        --first;
+                        product *= combinations[first].size();
+                    }
+
+                    fused_group group;
+                    group.first = first;
+                    group.count = i - first + 1;
+                    group.div = ps.divs[i];
+                    group.mod = product;
+                    group.div_shift = power_of_two_shift(group.div);
+                    group.mod_bits = power_of_two_shift(index_type(product));
+                    if (group.count > 1)
+                    {
+                        group.digits.resize(product * group.count);
+                        for (unsigned long long row = 0; row < product; ++row)
+                        {
+                            unsigned long long rest = row;
+                            for (long long d = i; d >= first; --d)
+                            {
+                                unsigned long long items = combinations[d].size();
+                                group.digits[row * group.count + (d - first)] = (unsigned short)(rest % items);
+                                rest /= items;
+                            }
+                        }
+                    }
+                    ps.groups.insert(ps.groups.begin(), group);
+                    i = first - 1;
+                }
+            }
+#ifdef USE_BOOST
+            static const int power_of_two_shift(const uint1024_t &value)
+            {
+                if (value == 0 || (value & (value - 1)) != 0)
+                {
+                    return -1;
+                }
+                return (int)msb(value);
+            }
+            // Reads `bits` bits starting at bit `shift` straight from the limbs.
+            static const unsigned long long extract_bits(const uint1024_t &n, const unsigned int &shift, const int &bits)
+            {
+                const limb_type *limbs = n.backend().limbs();
+                const unsigned int size = n.backend().size();
+                const unsigned int limb_bits = sizeof(limb_type) * 8;
+                unsigned int index = shift / limb_bits;
+                unsigned int offset = shift % limb_bits;
+                unsigned long long value = 0;
+                int taken = 0;
+
+                while (taken < bits && index < size)
+                {
+                    value |= (unsigned long long)(limbs[index] >> offset) << taken;
+                    taken += limb_bits - offset;
+                    offset = 0;
+                    ++index;
+                }
+
+                return bits >= 64 ? value : value & ((1ULL << bits) - 1);
+            }
+            static const unsigned long long decode_digit(const uint1024_t &n, const fused_group &group)
+            {
+                if (group.div_shift >= 0 && group.mod_bits >= 0)
+                {
+                    return extract_bits(n, group.div_shift, group.mod_bits);
+                }
+
+                uint1024_t quotient(group.div_shift >= 0 ? uint1024_t(n >> group.div_shift) : uint1024_t(n / group.div));
+                if (group.mod_bits >= 0)
+                {
+                    return (unsigned long long)(quotient & uint1024_t(group.mod - 1));
+                }
+                return (unsigned long long)(quotient % group.mod);
+            }
+#else
+            static const int power_of_two_shift(const unsigned long long &value)
+            {
+                if (value == 0 || (value & (value - 1)) != 0)
+                {
+                    return -1;
+                }
+
+                int shift = 0;
+                while ((value >> shift) != 1)
+                {
+                    ++shift;
+                }
+                return shift;
+            }
+            static const unsigned long long decode_digit(const unsigned long long &n, const fused_group &group)
+            {
+                unsigned long long quotient = group.div_shift >= 0 ? n >> group.div_shift : n / group.div;
+                return group.mod_bits >= 0 ? quotient & (group.mod - 1) : quotient % group.mod;
+            }
 #endif
+            static void append_row(vector<vector<string>> &subset, const vector<string> &row)
+            {
+                LCP_TIMER(timer);
+                subset.push_back(row);
+                LCP_COUNT(bytes_copied, row_bytes(row));
+                LCP_COUNT(allocations, 1 + heap_strings(row));
+                LCP_TIME(timer, copy_ns);
+            }
+            static const unsigned long long row_bytes(const vector<string> &row)
+            {
+                unsigned long long bytes = 0;
+                for (const string &value: row)
+                {
+                    bytes += value.size();
+                }
+                return bytes;
+            }
+            // Strings too long for the small-string buffer each cost an allocation.
+            static const unsigned long long heap_strings(const vector<string> &row)
+            {
+                static const unsigned long long inline_capacity = string().capacity();
+                unsigned long long count = 0;
+                for (const string &value: row)
+                {
+                    count += value.size() > inline_capacity;
+                }
+                return count;
+            }
+            template <class Row>
+            static void store_digit(const vector<vector<string>> &combinations, const fused_group &group, const unsigned long long &digit, Row &combination)
+            {
+                if (group.count == 1)
+                {
+                    const string &value = combinations[group.first][digit];
+                    combination[group.first].assign(value.data(), value.size());
+                    return;
+                }
+
+                const unsigned short *row = &group.digits[digit * group.count];
+                for (unsigned long long k = 0; k < group.count; ++k)
+                {
+                    const string &value = combinations[group.first + k][row[k]];
+                    combination[group.first + k].assign(value.data(), value.size());
+                }
+            }
+            // The container's allocator rebound for its rows or values, or a
+            // default one when it does not convert (e.g. a Boost container of
+            // std::string rows).
+            template <class Allocator, class Source>
+            static const Allocator allocator_from(const Source &source, std::true_type)
+            {
+                return Allocator(source);
+            }
+            template <class Allocator, class Source>
+            static const Allocator allocator_from(const Source &, std::false_type)
+            {
+                return Allocator();
+            }
+            // Decodes row `index` straight into a new element of `rows`,
+            // allocating only through the container's allocator.
+            template <class Rows>
+            static void append_row_into(const vector<vector<string>> &combinations, const index_type &index, const precomputed_stats &ps, Rows &rows)
+            {
+                typedef typename Rows::value_type row_type;
+                typedef typename row_type::value_type value_type;
+                typedef typename row_type::allocator_type row_allocator;
+                typedef typename value_type::allocator_type value_allocator;
+                LCP_TIMER(timer);
+                rows.emplace_back(combinations.size(), value_type(allocator_from<value_allocator>(rows.get_allocator(), std::is_constructible<value_allocator, typename Rows::allocator_type>())), allocator_from<row_allocator>(rows.get_allocator(), std::is_constructible<row_allocator, typename Rows::allocator_type>()));
+                for (const fused_group &group: ps.groups)
+                {
+                    store_digit(combinations, group, decode_digit(index, group), rows.back());
+                }
+                LCP_COUNT(rows_decoded, 1);
+                LCP_TIME(timer, decode_ns);
+            }
             lazy_cartesian_product() {}
     };
+
+    enum class lookup_strategy
+    {
+        plain,
+        fused
+    };
+
+    enum class enumerate_strategy
+    {
+        decode,
+        odometer
+    };
+
+    // The decode strategy picked for each operation of a cartesian_product.
+    // Profiles can be saved after calibration and loaded on the next run to
+    // skip it.
+    struct tuning_profile
+    {
+        lookup_strategy    lookup = lookup_strategy::fused;
+        unsigned long long fusion_limit = LCP_FUSION_LIMIT;
+        enumerate_strategy enumerate = enumerate_strategy::odometer;
+
+        void save(ostream &out) const
+        {
+            out << "lookup " << (lookup == lookup_strategy::plain ? "plain" : "fused") << " " << fusion_limit << "\n";
+            out << "enumerate " << (enumerate == enumerate_strategy::decode ? "decode" : "odometer") << "\n";
+        }
+        static const tuning_profile load(istream &in)
+        {
+            tuning_profile profile;
+            string key, lookup, enumerate;
+            if (!(in >> key >> lookup >> profile.fusion_limit) || key != "lookup" || !(in >> key >> enumerate) || key != "enumerate")
+            {
+                throw errors::invalid_profile_error();
+            }
+
+            if (lookup == "plain")
+            {
+                profile.lookup = lookup_strategy::plain;
+            }
+            else if (lookup != "fused")
+            {
+                throw errors::invalid_profile_error();
+            }
+            if (enumerate == "decode")
+            {
+                profile.enumerate = enumerate_strategy::decode;
+            }
+            else if (enumerate != "odometer")
+            {
+                throw errors::invalid_profile_error();
+            }
+            return profile;
+        }
+    };
+
+    // A spec bound to its precomputed stats. Unless a tuning_profile is given,
+    // construction runs a short calibration over the spec and keeps the
+    // fastest lookup and enumeration strategies. The combinations are not
+    // copied and must outlive the object.
+    class cartesian_product
+    {
+        public:
+            explicit cartesian_product(const vector<vector<string>> &combinations): spec(&combinations)
+            {
+                calibrate();
+            }
+            cartesian_product(const vector<vector<string>> &combinations, const tuning_profile &profile): spec(&combinations), tuning(profile)
+            {
+                LCP_ATTRIBUTE_TO(counters);
+                ps = stats_for(tuning);
+            }
+            // The combinations are referenced, so temporaries are refused.
+            cartesian_product(vector<vector<string>> &&combinations) = delete;
+            cartesian_product(vector<vector<string>> &&combinations, const tuning_profile &profile) = delete;
+
+            const vector<string> entry_at(const index_type &index) const
+            {
+                LCP_ATTRIBUTE_TO(counters);
+                if (index >= ps.max_size)
+                {
+                    throw errors::index_error();
+                }
+                return decode(index);
+            }
+            const vector<unsigned long long> indices_at(const index_type &index) const
+            {
+                LCP_ATTRIBUTE_TO(counters);
+                if (index >= ps.max_size)
+                {
+                    throw errors::index_error();
+                }
+                return digits_of(index);
+            }
+            // Calls `fn(row)` for every combination in [first, last).
+            template <class Function>
+            void for_each(const index_type &first, const index_type &last, Function fn, progress_monitor *progress = 0) const
+            {
+                LCP_ATTRIBUTE_TO(counters);
+                if (!progress)
+                {
+                    enumerate(first, last, fn);
+                    return;
+                }
+
+                progress_batch batch(progress);
+                enumerate(first, last, [&](const vector<string> &row)
+                {
+                    fn(row);
+                    batch.add_row();
+                });
+            }
+
+            const index_type &max_size(void) const
+            {
+                return ps.max_size;
+            }
+            const precomputed_stats &stats(void) const
+            {
+                return ps;
+            }
+            const tuning_profile &profile(void) const
+            {
+                return tuning;
+            }
+            const vector<vector<string>> &combinations(void) const
+            {
+                return *spec;
+            }
+            // Work done through this object by every thread, see instrumentation_snapshot.
+            const instrumentation_snapshot instrumentation(void) const
+            {
+#ifdef LCP_INSTRUMENTATION
+                return counters.snapshot();
+#else
+                instrumentation_snapshot empty = {};
+                return empty;
+#endif
+            }
+
+        private:
+            const precomputed_stats stats_for(const tuning_profile &profile) const
+            {
+                unsigned long long limit = profile.lookup == lookup_strategy::fused ? profile.fusion_limit : 0;
+#ifdef USE_BOOST
+                return lazy_cartesian_product::boost_precompute(*spec, limit);
+#else
+                return lazy_cartesian_product::precompute(*spec, limit);
+#endif
+            }
+            const vector<unsigned long long> digits_of(const index_type &index) const
+            {
+#ifdef USE_BOOST
+                return lazy_cartesian_product::boost_indices_at(*spec, index, ps);
+#else
+                return lazy_cartesian_product::indices_at(*spec, index, ps);
+#endif
+            }
+            template <class Function>
+            void enumerate(const index_type &first, const index_type &last, Function fn) const
+            {
+                if (first >= last || last > ps.max_size)
+                {
+                    if (first < last)
+                    {
+                        throw errors::index_error();
+                    }
+                    return;
+                }
+
+                if (tuning.enumerate == enumerate_strategy::decode)
+                {
+                    for (index_type i = first; i < last; ++i)
+                    {
+                        const vector<string> row = decode(i);
+                        fn(row);
+                    }
+                    return;
+                }
+
+                vector<unsigned long long> digits = digits_of(first);
+                vector<string> row = decode(first);
+                index_type remaining = last - first;
+                while (true)
+                {
+                    fn((const vector<string> &)row);
+                    if (--remaining == 0)
+                    {
+                        break;
+                    }
+                    LCP_COUNT(rows_decoded, 1);
+                    for (long long d = digits.size() - 1; d >= 0; --d)
+                    {
+                        const vector<string> &values = (*spec)[d];
+                        if (++digits[d] < values.size())
+                        {
+                            row[d] = values[digits[d]];
+                            LCP_COUNT(bytes_copied, row[d].size());
+                            break;
+                        }
+                        digits[d] = 0;
+                        row[d] = values[0];
+                        LCP_COUNT(bytes_copied, row[d].size());
+                    }
+                }
+            }
+            const vector<string> decode(const index_type &index) const
+            {
+#ifdef USE_BOOST
+                return lazy_cartesian_product::boost_entry_at(*spec, index, ps);
+#else
+                return lazy_cartesian_product::entry_at(*spec, index, ps);
+#endif
+            }
+            template <class Operation>
+            static const double best_time(Operation operation)
+            {
+                double best = 0;
+                for (int repeat = 0; repeat < 3; ++repeat)
+                {
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    operation();
+                    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    if (repeat == 0 || elapsed < best)
+                    {
+                        best = elapsed;
+                    }
+                }
+                return best;
+            }
+            void calibrate(void)
+            {
+                tuning_profile candidate;
+                candidate.lookup = lookup_strategy::plain;
+                ps = stats_for(candidate);
+                tuning = candidate;
+                if (ps.max_size == 0)
+                {
+                    return;
+                }
+
+                mt19937_64 gen(LCP_CALIBRATION_ROWS);
+                vector<index_type> sample(LCP_CALIBRATION_ROWS);
+                for (index_type &index: sample)
+                {
+#ifdef USE_BOOST
+                    for (int word = 0; word < 16; ++word)
+                    {
+                        index = (index << 64) | uint1024_t(gen());
+                    }
+                    index %= ps.max_size;
+#else
+                    index = gen() % ps.max_size;
+#endif
+                }
+
+                // Summed over every timed row and stored once in a volatile, so
+                // the timed decodes cannot be optimized away.
+                unsigned long long checksum = 0;
+                double best = 0;
+                const unsigned long long limits[] = { 0, 16, LCP_FUSION_LIMIT, 4096 };
+                for (const unsigned long long &limit: limits)
+                {
+                    candidate.lookup = limit == 0 ? lookup_strategy::plain : lookup_strategy::fused;
+                    candidate.fusion_limit = limit == 0 ? tuning.fusion_limit : limit;
+                    precomputed_stats stats = stats_for(candidate);
+                    if (limit != 0 && stats.groups.size() == spec->size())
+                    {
+                        continue;
+                    }
+
+                    ps.groups.swap(stats.groups);
+                    double elapsed = best_time([&]()
+                    {
+                        for (const index_type &index: sample)
+                        {
+                            checksum += decode(index)[0].size();
+                        }
+                    });
+                    if (limit == 0 || elapsed < best)
+                    {
+                        best = elapsed;
+                        tuning.lookup = candidate.lookup;
+                        tuning.fusion_limit = candidate.fusion_limit;
+                    }
+                }
+                {
+                    LCP_ATTRIBUTE_TO(counters);
+                    ps = stats_for(tuning);
+                }
+
+                index_type last = ps.max_size < LCP_CALIBRATION_ROWS ? ps.max_size : index_type(LCP_CALIBRATION_ROWS);
+                const enumerate_strategy strategies[] = { enumerate_strategy::decode, enumerate_strategy::odometer };
+                for (const enumerate_strategy &strategy: strategies)
+                {
+                    tuning.enumerate = strategy;
+                    double elapsed = best_time([&]()
+                    {
+                        enumerate(0, last, [&](const vector<string> &row)
+                        {
+                            checksum += row[0].size();
+                        });
+                    });
+                    if (strategy == enumerate_strategy::decode || elapsed < best)
+                    {
+                        best = elapsed;
+                        candidate.enumerate = strategy;
+                    }
+                }
+                tuning.enumerate = candidate.enumerate;
+                volatile unsigned long long sink = checksum;
+                (void)sink;
+            }
+
+            const vector<vector<string>> *spec;
+            tuning_profile                tuning;
+            precomputed_stats             ps;
+#ifdef LCP_INSTRUMENTATION
+            mutable lazycp::instrumentation::shared_counters counters;
+#endif
+    };
+
+    struct cache_stats
+    {
+        unsigned long long hits;
+        unsigned long long misses;
+    };
+
+    // An LRU cache of decoded blocks in front of cartesian_product::entry_at.
+    // Each block covers LCP_CACHE_BLOCK_ROWS consecutive indices and stores
+    // one value-index column per dimension, so a warm lookup is a probe of
+    // one shard plus the string copies. Blocks are spread over independently
+    // locked shards so concurrent lookups rarely contend.
+    class block_cache
+    {
+        public:
+            block_cache(const cartesian_product &product, const unsigned long long &capacity = 256, const unsigned long long &shard_count = 16): product(product), hits(0), misses(0)
+            {
+                unsigned long long count = shard_count > 0 ? shard_count : 1;
+                per_shard = (capacity + count - 1) / count;
+                if (per_shard == 0)
+                {
+                    per_shard = 1;
+                }
+                for (unsigned long long i = 0; i < count; ++i)
+                {
+                    shards.push_back(std::unique_ptr<shard>(new shard()));
+                }
+            }
+
+            const vector<string> entry_at(const index_type &index)
+            {
+                if (index >= product.max_size())
+                {
+                    throw errors::index_error();
+                }
+
+                const index_type number = index / LCP_CACHE_BLOCK_ROWS;
+                const unsigned long long row = (unsigned long long)(index % LCP_CACHE_BLOCK_ROWS);
+                std::shared_ptr<const block> found = fetch(number);
+
+                const vector<vector<string>> &combinations = product.combinations();
+                vector<string> combination(combinations.size());
+                for (unsigned long long d = 0; d < combinations.size(); ++d)
+                {
+                    combination[d] = combinations[d][found->columns[d][row]];
+                }
+                return combination;
+            }
+            const cache_stats stats(void) const
+            {
+                cache_stats current;
+                current.hits = hits.load(std::memory_order_relaxed);
+                current.misses = misses.load(std::memory_order_relaxed);
+                return current;
+            }
+
+        private:
+            struct block
+            {
+                vector<vector<unsigned int>> columns;
+            };
+            struct shard
+            {
+                std::mutex                                                                             lock;
+                std::list<index_type>                                                                  order;
+                std::map<index_type, std::pair<std::shared_ptr<const block>, std::list<index_type>::iterator>> blocks;
+            };
+
+            std::shared_ptr<const block> fetch(const index_type &number)
+            {
+                shard &owner = *shards[(unsigned long long)(number % shards.size())];
+                {
+                    std::lock_guard<std::mutex> guard(owner.lock);
+                    auto it = owner.blocks.find(number);
+                    if (it != owner.blocks.end())
+                    {
+                        owner.order.splice(owner.order.begin(), owner.order, it->second.second);
+                        hits.fetch_add(1, std::memory_order_relaxed);
+                        return it->second.first;
+                    }
+                }
+
+                misses.fetch_add(1, std::memory_order_relaxed);
+                std::shared_ptr<const block> decoded = decode(number);
+
+                std::lock_guard<std::mutex> guard(owner.lock);
+                auto it = owner.blocks.find(number);
+                if (it != owner.blocks.end())
+                {
+                    return it->second.first;
+                }
+                owner.order.push_front(number);
+                owner.blocks[number] = std::make_pair(decoded, owner.order.begin());
+                if (owner.blocks.size() > per_shard)
+                {
+                    owner.blocks.erase(owner.order.back());
+                    owner.order.pop_back();
+                }
+                return decoded;
+            }
+            std::shared_ptr<const block> decode(const index_type &number) const
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                const index_type first = number * LCP_CACHE_BLOCK_ROWS;
+                const index_type left = product.max_size() - first;
+                const unsigned long long rows = left < LCP_CACHE_BLOCK_ROWS ? (unsigned long long)left : LCP_CACHE_BLOCK_ROWS;
+
+                std::shared_ptr<block> decoded(new block());
+                decoded->columns.resize(combinations.size());
+                for (vector<unsigned int> &column: decoded->columns)
+                {
+                    column.resize(rows);
+                }
+
+                vector<unsigned long long> digits = product.indices_at(first);
+#ifdef LCP_USE_KERNELS
+                vector<unsigned long long> sizes(combinations.size());
+                vector<unsigned int *> columns(combinations.size());
+                for (unsigned long long d = 0; d < combinations.size(); ++d)
+                {
+                    sizes[d] = combinations[d].size();
+                    columns[d] = decoded->columns[d].data();
+                }
+                kernels::fill_columns(digits.data(), sizes.data(), digits.size(), rows, columns.data());
+                return decoded;
+#endif
+                for (unsigned long long row = 0; row < rows; ++row)
+                {
+                    for (unsigned long long d = 0; d < digits.size(); ++d)
+                    {
+                        decoded->columns[d][row] = (unsigned int)digits[d];
+                    }
+                    for (long long d = digits.size() - 1; d >= 0; --d)
+                    {
+                        if (++digits[d] < combinations[d].size())
+                        {
+                            break;
+                        }
+                        digits[d] = 0;
+                    }
+                }
+                return decoded;
+            }
+
+            const cartesian_product               &product;
+            vector<std::unique_ptr<shard>>        shards;
+            unsigned long long                    per_shard;
+            std::atomic<unsigned long long>       hits;
+            std::atomic<unsigned long long>       misses;
+    };
+
+    // Records spans per thread and dumps them as Chrome trace JSON (load the
+    // output in chrome://tracing or Perfetto). Each thread appends to its own
+    // preallocated buffer without locking; a lock is only taken the first time
+    // a thread records into a tracer. Spans past LCP_TRACE_EVENTS per thread
+    // are dropped and counted.
+    class tracer
+    {
+        public:
+            // Measures from construction to destruction. A null tracer makes
+            // the span a no-op, so callers can keep tracing optional.
+            class span
+            {
+                public:
+                    span(tracer *owner, const char *name): owner(owner), name(name), start(owner ? owner->now() : 0) {}
+                    ~span()
+                    {
+                        if (owner)
+                        {
+                            owner->record(name, start, owner->now());
+                        }
+                    }
+
+                private:
+                    tracer             *owner;
+                    const char         *name;
+                    unsigned long long start;
+            };
+
+            explicit tracer(const unsigned long long &events_per_thread = LCP_TRACE_EVENTS): capacity(events_per_thread), id(next_id()), origin(std::chrono::steady_clock::now())
+            {
+                std::lock_guard<std::mutex> guard(registry_lock());
+                live().insert(id);
+            }
+            ~tracer()
+            {
+                std::lock_guard<std::mutex> guard(registry_lock());
+                live().erase(id);
+            }
+
+            void write_chrome_trace(ostream &out)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                out << "{\"traceEvents\":[";
+                bool first = true;
+                for (const thread_buffer &buffer: buffers)
+                {
+                    out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer.tid
+                        << ",\"args\":{\"name\":\"thread " << buffer.tid << "\"}}";
+                    first = false;
+                    const unsigned long long size = buffer.size.load(std::memory_order_acquire);
+                    for (unsigned long long i = 0; i < size; ++i)
+                    {
+                        const event &e = buffer.events[i];
+                        out << ",\n{\"name\":";
+                        write_json_string(out, e.name);
+                        out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.tid
+                            << ",\"ts\":" << e.start / 1000 << "." << (e.start / 100) % 10
+                            << ",\"dur\":" << (e.end - e.start) / 1000 << "." << ((e.end - e.start) / 100) % 10 << "}";
+                    }
+                }
+                out << "\n]}\n";
+            }
+            const unsigned long long dropped(void)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                unsigned long long total = 0;
+                for (const thread_buffer &buffer: buffers)
+                {
+                    total += buffer.dropped.load(std::memory_order_relaxed);
+                }
+                return total;
+            }
+
+        private:
+            struct event
+            {
+                const char         *name;
+                unsigned long long start;
+                unsigned long long end;
+            };
+            struct thread_buffer
+            {
+                unsigned long long              tid;
+                vector<event>                   events;
+                std::atomic<unsigned long long> size;
+                std::atomic<unsigned long long> dropped;
+            };
+
+            static const unsigned long long next_id(void)
+            {
+                static std::atomic<unsigned long long> ids(0);
+                return ++ids;
+            }
+            // Ids of the tracers that still exist. Ids are never reused, so a
+            // thread's stale registrations can be dropped by checking them
+            // against this set.
+            static std::set<unsigned long long> &live(void)
+            {
+                static std::set<unsigned long long> ids;
+                return ids;
+            }
+            static std::mutex &registry_lock(void)
+            {
+                static std::mutex registry;
+                return registry;
+            }
+            static void write_json_string(ostream &out, const char *text)
+            {
+                out << '"';
+                for (; *text; ++text)
+                {
+                    const unsigned char c = *text;
+                    if (c == '"' || c == '\\')
+                    {
+                        out << '\\' << (char)c;
+                    }
+                    else if (c < 0x20)
+                    {
+                        const char *hex = "0123456789abcdef";
+                        out << "\\u00" << hex[c >> 4] << hex[c & 15];
+                    }
+                    else
+                    {
+                        out << (char)c;
+                    }
+                }
+                out << '"';
+            }
+            const unsigned long long now(void) const
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+            }
+            thread_buffer &local_buffer(void)
+            {
+                thread_local vector<std::pair<unsigned long long, thread_buffer *>> registered;
+                for (const std::pair<unsigned long long, thread_buffer *> &entry: registered)
+                {
+                    if (entry.first == id)
+                    {
+                        return *entry.second;
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> guard(registry_lock());
+                    const std::set<unsigned long long> &ids = live();
+                    registered.erase(std::remove_if(registered.begin(), registered.end(), [&](const std::pair<unsigned long long, thread_buffer *> &entry)
+                    {
+                        return ids.find(entry.first) == ids.end();
+                    }), registered.end());
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                buffers.emplace_back();
+                thread_buffer &buffer = buffers.back();
+                buffer.tid = buffers.size();
+                buffer.events.resize(capacity);
+                buffer.size.store(0, std::memory_order_relaxed);
+                buffer.dropped.store(0, std::memory_order_relaxed);
+                registered.push_back(std::make_pair(id, &buffer));
+                return buffer;
+            }
+            void record(const char *name, const unsigned long long &start, const unsigned long long &end)
+            {
+                thread_buffer &buffer = local_buffer();
+                const unsigned long long size = buffer.size.load(std::memory_order_relaxed);
+                if (size >= buffer.events.size())
+                {
+                    buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                event &e = buffer.events[size];
+                e.name = name;
+                e.start = start;
+                e.end = end;
+                buffer.size.store(size + 1, std::memory_order_release);
+            }
+
+            const unsigned long long                    capacity;
+            const unsigned long long                    id;
+            const std::chrono::steady_clock::time_point origin;
+            std::mutex                                  lock;
+            std::list<thread_buffer>                    buffers;
+    };
+
+#ifndef LCP_NO_THREADS
+    // Writes a range of a cartesian_product as delimiter-separated lines
+    // using worker threads. Workers claim chunks of LCP_PARALLEL_CHUNK_ROWS
+    // rows, decode them into value indices and format them; the calling
+    // thread writes the chunks in order. Workers stop when they get more than
+    // two chunks per thread ahead of the writer. If a worker or the output
+    // throws, the other threads are stopped and joined before the exception
+    // leaves write(). With a tracer, every stage is recorded as a "decode",
+    // "format", "backpressure", "writer_wait" or "write" span.
+    class parallel_writer
+    {
+        public:
+            parallel_writer(const cartesian_product &product, const unsigned int &threads = std::thread::hardware_concurrency(), tracer *trace = 0): product(product), threads(threads > 0 ? threads : 1), trace(trace) {}
+
+            void write(const index_type &first, const index_type &last, ostream &out, const string &delimiter = ",", progress_monitor *progress = 0)
+            {
+                if (first > last || last > product.max_size())
+                {
+                    throw errors::index_error();
+                }
+
+                const index_type total = last - first;
+                const unsigned long long chunks = (unsigned long long)((total + (LCP_PARALLEL_CHUNK_ROWS - 1)) / LCP_PARALLEL_CHUNK_ROWS);
+                const unsigned long long window = threads * 2;
+                vector<string> slots(window);
+                vector<char> ready(window, 0);
+                std::atomic<unsigned long long> claimed(0);
+                unsigned long long written = 0;
+                std::mutex lock;
+                std::condition_variable changed;
+
+                bool aborted = false;
+                std::exception_ptr failure;
+                {
+                    worker_group workers(lock, changed, aborted);
+                    workers.threads.reserve(threads);
+                    for (unsigned int t = 0; t < threads; ++t)
+                    {
+                        workers.threads.push_back(std::thread([&]()
+                        {
+                            try
+                            {
+                                vector<unsigned int> digits;
+                                string text;
+                                for (unsigned long long chunk = claimed++; chunk < chunks; chunk = claimed++)
+                                {
+                                    {
+                                        tracer::span waiting(trace, "backpressure");
+                                        std::unique_lock<std::mutex> guard(lock);
+                                        changed.wait(guard, [&]() { return aborted || chunk < written + window; });
+                                        if (aborted)
+                                        {
+                                            return;
+                                        }
+                                    }
+
+                                    const index_type start = first + index_type(chunk) * LCP_PARALLEL_CHUNK_ROWS;
+                                    const index_type left = last - start;
+                                    const unsigned long long rows = left < LCP_PARALLEL_CHUNK_ROWS ? (unsigned long long)left : LCP_PARALLEL_CHUNK_ROWS;
+                                    {
+                                        tracer::span decoding(trace, "decode");
+                                        decode(start, rows, digits);
+                                    }
+                                    {
+                                        tracer::span formatting(trace, "format");
+                                        format(digits, rows, delimiter, text);
+                                    }
+
+                                    std::lock_guard<std::mutex> guard(lock);
+                                    slots[chunk % window].swap(text);
+                                    ready[chunk % window] = 1;
+                                    changed.notify_all();
+                                }
+                            }
+                            catch (...)
+                            {
+                                std::lock_guard<std::mutex> guard(lock);
+                                if (!failure)
+                                {
+                                    failure = std::current_exception();
+                                }
+                                aborted = true;
+                                changed.notify_all();
+                            }
+                        }));
+                    }
+
+                    for (unsigned long long chunk = 0; chunk < chunks; ++chunk)
+                    {
+                        string text;
+                        {
+                            tracer::span waiting(trace, "writer_wait");
+                            std::unique_lock<std::mutex> guard(lock);
+                            changed.wait(guard, [&]() { return aborted || ready[chunk % window] != 0; });
+                            if (aborted)
+                            {
+                                break;
+                            }
+                            text.swap(slots[chunk % window]);
+                            ready[chunk % window] = 0;
+                        }
+                        {
+                            tracer::span writing(trace, "write");
+                            LCP_TIMER(output_timer);
+                            out.write(text.data(), text.size());
+                            LCP_TIME(output_timer, output_ns);
+                        }
+                        if (progress)
+                        {
+                            const index_type left = last - first - index_type(chunk) * LCP_PARALLEL_CHUNK_ROWS;
+                            progress->add(left < LCP_PARALLEL_CHUNK_ROWS ? (unsigned long long)left : LCP_PARALLEL_CHUNK_ROWS);
+                        }
+
+                        std::lock_guard<std::mutex> guard(lock);
+                        written = chunk + 1;
+                        changed.notify_all();
+                    }
+                }
+                if (failure)
+                {
+                    std::rethrow_exception(failure);
+                }
+            }
+
+        private:
+            // Owns the worker threads of one write(). However write() is left,
+            // the destructor wakes any worker waiting on backpressure, tells it
+            // to stop and joins it.
+            struct worker_group
+            {
+                worker_group(std::mutex &lock, std::condition_variable &changed, bool &aborted): lock(lock), changed(changed), aborted(aborted) {}
+                ~worker_group()
+                {
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        aborted = true;
+                    }
+                    changed.notify_all();
+                    for (std::thread &thread: threads)
+                    {
+                        thread.join();
+                    }
+                }
+
+                std::mutex              &lock;
+                std::condition_variable &changed;
+                bool                    &aborted;
+                vector<std::thread>     threads;
+            };
+
+            void decode(const index_type &start, const unsigned long long &rows, vector<unsigned int> &digits) const
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                const unsigned long long length = combinations.size();
+                vector<unsigned long long> current = product.indices_at(start);
+                digits.resize(rows * length);
+                LCP_COUNT(rows_decoded, rows);
+#ifdef LCP_USE_KERNELS
+                vector<unsigned long long> sizes(length);
+                vector<unsigned int *> columns(length);
+                for (unsigned long long d = 0; d < length; ++d)
+                {
+                    sizes[d] = combinations[d].size();
+                    columns[d] = &digits[d * rows];
+                }
+                kernels::fill_columns(current.data(), sizes.data(), length, rows, columns.data());
+                return;
+#endif
+                for (unsigned long long row = 0; row < rows; ++row)
+                {
+                    for (unsigned long long d = 0; d < length; ++d)
+                    {
+                        digits[d * rows + row] = (unsigned int)current[d];
+                    }
+                    for (long long d = length - 1; d >= 0; --d)
+                    {
+                        if (++current[d] < combinations[d].size())
+                        {
+                            break;
+                        }
+                        current[d] = 0;
+                    }
+                }
+            }
+            void format(const vector<unsigned int> &digits, const unsigned long long &rows, const string &delimiter, string &text) const
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                const unsigned long long length = combinations.size();
+                text.clear();
+                for (unsigned long long row = 0; row < rows; ++row)
+                {
+                    for (unsigned long long d = 0; d < length; ++d)
+                    {
+                        if (d > 0)
+                        {
+                            text.append(delimiter);
+                        }
+                        text.append(combinations[d][digits[d * rows + row]]);
+                    }
+                    text.push_back('\n');
+                }
+                LCP_COUNT(bytes_copied, text.size());
+            }
+
+            const cartesian_product &product;
+            const unsigned int      threads;
+            tracer                  *trace;
+    };
+#endif
+
+    // A row format compiled once: a format such as "{2}-{0}:{1}" becomes a
+    // list of (literal, dimension) steps and a trailing literal, and every
+    // referenced value is rendered in advance, so a row is a fixed sequence
+    // of appends. "{n:w}" pads dimension n with spaces to at least w
+    // characters; "{{" and "}}" are literal braces. Unpadded references
+    // point into the spec, which must outlive the template.
+    class row_template
+    {
+        public:
+            row_template(const vector<vector<string>> &combinations, const string &format): padded(new vector<vector<string>>())
+            {
+                string literal;
+                vector<unsigned long long> widths;
+                for (unsigned long long i = 0; i < format.size(); ++i)
+                {
+                    const char c = format[i];
+                    if ((c == '{' || c == '}') && i + 1 < format.size() && format[i + 1] == c)
+                    {
+                        literal.push_back(c);
+                        ++i;
+                        continue;
+                    }
+                    if (c == '}')
+                    {
+                        throw errors::invalid_template_error();
+                    }
+                    if (c != '{')
+                    {
+                        literal.push_back(c);
+                        continue;
+                    }
+
+                    unsigned long long dimension = 0, width = 0;
+                    if (!parse_number(format, ++i, dimension) || dimension >= combinations.size())
+                    {
+                        throw errors::invalid_template_error();
+                    }
+                    if (i < format.size() && format[i] == ':' && !parse_number(format, ++i, width))
+                    {
+                        throw errors::invalid_template_error();
+                    }
+                    if (i >= format.size() || format[i] != '}')
+                    {
+                        throw errors::invalid_template_error();
+                    }
+                    step next;
+                    next.prefix = literal;
+                    next.dimension = dimension;
+                    steps.push_back(next);
+                    widths.push_back(width);
+                    literal.clear();
+                }
+                suffix = literal;
+                render_values(combinations, widths);
+            }
+
+            // Values joined by `delimiter`, like the writers' default output.
+            static const row_template delimited(const vector<vector<string>> &combinations, const string &delimiter)
+            {
+                row_template format;
+                for (unsigned long long d = 0; d < combinations.size(); ++d)
+                {
+                    step next;
+                    next.prefix = d > 0 ? delimiter : string();
+                    next.dimension = d;
+                    format.steps.push_back(next);
+                }
+                format.render_values(combinations, vector<unsigned long long>(combinations.size(), 0));
+                return format;
+            }
+
+            // Appends the row with value indices `digits` to `out`.
+            void render(const vector<unsigned long long> &digits, string &out) const
+            {
+                for (const step &s: steps)
+                {
+                    out.append(s.prefix);
+                    out.append((*s.values)[digits[s.dimension]]);
+                }
+                out.append(suffix);
+            }
+            const string render(const vector<unsigned long long> &digits) const
+            {
+                string out;
+                render(digits, out);
+                return out;
+            }
+
+        private:
+            struct step
+            {
+                string                 prefix;
+                unsigned long long     dimension;
+                const vector<string>   *values;
+            };
+
+            row_template(): padded(new vector<vector<string>>()) {}
+
+            static const bool parse_number(const string &format, unsigned long long &i, unsigned long long &number)
+            {
+                const unsigned long long start = i;
+                number = 0;
+                for (; i < format.size() && format[i] >= '0' && format[i] <= '9'; ++i)
+                {
+                    number = number * 10 + (format[i] - '0');
+                }
+                return i > start && i - start < 19;
+            }
+            // Points every step at its values: the spec's own strings, or a
+            // padded copy when the reference has a width. The copies are
+            // shared, so copies of the template stay valid.
+            void render_values(const vector<vector<string>> &combinations, const vector<unsigned long long> &widths)
+            {
+                unsigned long long copies = 0;
+                for (const unsigned long long &width: widths)
+                {
+                    copies += width > 0;
+                }
+                padded->reserve(copies);
+                for (unsigned long long k = 0; k < steps.size(); ++k)
+                {
+                    const vector<string> &values = combinations[steps[k].dimension];
+                    if (widths[k] == 0)
+                    {
+                        steps[k].values = &values;
+                        continue;
+                    }
+                    padded->push_back(values);
+                    for (string &value: padded->back())
+                    {
+                        if (value.size() < widths[k])
+                        {
+                            value.append(widths[k] - value.size(), ' ');
+                        }
+                    }
+                    steps[k].values = &padded->back();
+                }
+            }
+
+            vector<step>                                   steps;
+            string                                         suffix;
+            std::shared_ptr<vector<vector<string>>>        padded;
+    };
+
+    // The state of an enumeration_writer or sample_writer between two steps:
+    // the next index to write (and the same cursor as a digit vector), the
+    // sampler state, the rows written and the bytes of output produced so
+    // far. Resuming from a checkpoint reproduces the rest of the output byte
+    // for byte, so the output can be reopened and written from `output_offset`.
+    struct checkpoint
+    {
+        string                     kind;
+        index_type                 cursor;
+        index_type                 last;
+        vector<unsigned long long> digits;
+        string                     sampler;
+        index_type                 rows_done;
+        unsigned long long         output_offset;
+
+        void save(ostream &out) const
+        {
+            out << "lcp-checkpoint 1\n";
+            out << "kind " << kind << "\n";
+            out << "cursor " << cursor << "\n";
+            out << "last " << last << "\n";
+            out << "digits " << digits.size();
+            for (const unsigned long long &digit: digits)
+            {
+                out << " " << digit;
+            }
+            out << "\n";
+            out << "rows " << rows_done << "\n";
+            out << "offset " << output_offset << "\n";
+            out << "sampler " << sampler << "\n";
+        }
+        static const checkpoint load(istream &in)
+        {
+            checkpoint state;
+            string key;
+            int version = 0;
+            unsigned long long count = 0;
+            if (!(in >> key >> version) || key != "lcp-checkpoint" || version != 1
+                || !(in >> key >> state.kind) || key != "kind"
+                || !(in >> key >> state.cursor) || key != "cursor"
+                || !(in >> key >> state.last) || key != "last"
+                || !(in >> key >> count) || key != "digits")
+            {
+                throw errors::invalid_checkpoint_error();
+            }
+            state.digits.resize(count);
+            for (unsigned long long &digit: state.digits)
+            {
+                if (!(in >> digit))
+                {
+                    throw errors::invalid_checkpoint_error();
+                }
+            }
+            if (!(in >> key >> state.rows_done) || key != "rows"
+                || !(in >> key >> state.output_offset) || key != "offset"
+                || !(in >> key) || key != "sampler")
+            {
+                throw errors::invalid_checkpoint_error();
+            }
+            std::getline(in, state.sampler);
+            if (!state.sampler.empty() && state.sampler[0] == ' ')
+            {
+                state.sampler.erase(0, 1);
+            }
+            return state;
+        }
+    };
+
+    // Streams the rows in [first, last) as delimiter-separated (or templated) lines in
+    // steps, so the job can be checkpointed between steps and resumed.
+    class enumeration_writer
+    {
+        public:
+            enumeration_writer(const cartesian_product &product, const index_type &first, const index_type &last, const string &delimiter = ","): enumeration_writer(product, first, last, row_template::delimited(product.combinations(), delimiter)) {}
+            enumeration_writer(const cartesian_product &product, const checkpoint &resume, const string &delimiter = ","): enumeration_writer(product, resume, row_template::delimited(product.combinations(), delimiter)) {}
+            enumeration_writer(const cartesian_product &product, const index_type &first, const index_type &last, const row_template &format): product(product), format(format)
+            {
+                if (first > last || last > product.max_size())
+                {
+                    throw errors::index_error();
+                }
+                state.kind = "enumerate";
+                state.cursor = first;
+                state.last = last;
+                state.rows_done = 0;
+                state.output_offset = 0;
+                if (first < last)
+                {
+                    state.digits = product.indices_at(first);
+                }
+            }
+            enumeration_writer(const cartesian_product &product, const checkpoint &resume, const row_template &format): product(product), state(resume), format(format)
+            {
+                if (state.kind != "enumerate" || state.cursor > state.last || state.last > product.max_size()
+                    || (state.cursor < state.last && state.digits != product.indices_at(state.cursor)))
+                {
+                    throw errors::invalid_checkpoint_error();
+                }
+            }
+
+            const bool has_next(void) const
+            {
+                return state.cursor < state.last;
+            }
+            // Writes up to `rows` rows and returns whether any remain.
+            const bool step(ostream &out, const unsigned long long &rows)
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                string text;
+                unsigned long long count = 0;
+                for (; count < rows && state.cursor < state.last; ++count)
+                {
+                    format.render(state.digits, text);
+                    text.push_back('\n');
+
+                    ++state.cursor;
+                    for (long long d = state.digits.size() - 1; d >= 0; --d)
+                    {
+                        if (++state.digits[d] < combinations[d].size())
+                        {
+                            break;
+                        }
+                        state.digits[d] = 0;
+                    }
+                }
+                out.write(text.data(), text.size());
+                state.rows_done += count;
+                state.output_offset += text.size();
+                return has_next();
+            }
+            const checkpoint &save(void) const
+            {
+                return state;
+            }
+
+        private:
+            const cartesian_product &product;
+            checkpoint              state;
+            const row_template      format;
+    };
+
+    // Streams a random sample (as RandomIterator draws it) as
+    // delimiter-separated (or templated) lines in steps, so the job can be checkpointed
+    // between steps and resumed with the same random draws.
+    class sample_writer
+    {
+        public:
+            sample_writer(const cartesian_product &product, const index_type &sample_size, const string &delimiter = ","): sample_writer(product, sample_size, row_template::delimited(product.combinations(), delimiter)) {}
+            sample_writer(const cartesian_product &product, const checkpoint &resume, const string &delimiter = ","): sample_writer(product, resume, row_template::delimited(product.combinations(), delimiter)) {}
+            sample_writer(const cartesian_product &product, const index_type &sample_size, const row_template &format): product(product), iter(sample_size, product.max_size()), format(format)
+            {
+                if (sample_size > product.max_size())
+                {
+                    throw errors::invalid_sample_size_error();
+                }
+                state.kind = "sample";
+                state.cursor = 0;
+                state.last = sample_size;
+                state.rows_done = 0;
+                state.output_offset = 0;
+            }
+            sample_writer(const cartesian_product &product, const checkpoint &resume, const row_template &format): product(product), iter(index_type(0), index_type(0)), state(resume), format(format)
+            {
+                if (state.kind != "sample")
+                {
+                    throw errors::invalid_checkpoint_error();
+                }
+                std::istringstream in(state.sampler);
+                iter.load(in);
+            }
+
+            const bool has_next(void)
+            {
+                return iter.has_next();
+            }
+            const bool step(ostream &out, const unsigned long long &rows)
+            {
+                string text;
+                unsigned long long count = 0;
+                for (; count < rows && iter.has_next(); ++count)
+                {
+#ifdef USE_BOOST
+                    format.render(lazy_cartesian_product::boost_indices_at(product.combinations(), iter.next(), product.stats()), text);
+#else
+                    format.render(lazy_cartesian_product::indices_at(product.combinations(), iter.next(), product.stats()), text);
+#endif
+                    text.push_back('\n');
+                }
+                out.write(text.data(), text.size());
+                state.rows_done += count;
+                state.output_offset += text.size();
+                return iter.has_next();
+            }
+            const checkpoint &save(void)
+            {
+                std::ostringstream out;
+                iter.save(out);
+                state.sampler = out.str();
+                state.cursor = state.rows_done;
+                return state;
+            }
+
+        private:
+            const cartesian_product &product;
+            RandomIterator          iter;
+            checkpoint              state;
+            const row_template      format;
+    };
+
+    // A random sample that is materialized as rows when it fits in
+    // `budget` bytes and is otherwise streamed: only the sampler's starting
+    // state is kept, and every for_each() replays the same draws. Either way
+    // the rows are drawn by RandomIterator, in ascending order.
+    class sample_set
+    {
+        public:
+            sample_set(const cartesian_product &product, const index_type &sample_size, const unsigned long long &budget = LCP_MEMORY_BUDGET): product(product), origin(sample_size, product.max_size()), full(sample_size == product.max_size())
+            {
+                plan = estimate(product, sample_size, budget);
+                if (plan.streaming)
+                {
+                    return;
+                }
+                rows.reserve((unsigned long long)plan.rows);
+                visit([this](const vector<string> &row)
+                {
+                    rows.push_back(row);
+                });
+            }
+
+            // Estimates the memory a vector<vector<string>> holding
+            // `sample_size` rows of `product` takes, as
+            // lazy_cartesian_product::estimate_memory does.
+            static const memory_plan estimate(const cartesian_product &product, const index_type &sample_size, const unsigned long long &budget = LCP_MEMORY_BUDGET)
+            {
+                if (sample_size > product.max_size())
+                {
+                    throw errors::invalid_sample_size_error();
+                }
+                return lazy_cartesian_product::estimate_memory(product.combinations(), sample_size, budget);
+            }
+
+            const memory_plan &footprint(void) const
+            {
+                return plan;
+            }
+            const bool streaming(void) const
+            {
+                return plan.streaming;
+            }
+            const index_type &size(void) const
+            {
+                return plan.rows;
+            }
+            // Calls `fn(row)` for every sampled row in ascending index order.
+            template <class Function>
+            void for_each(Function fn) const
+            {
+                if (!plan.streaming)
+                {
+                    for (const vector<string> &row: rows)
+                    {
+                        fn(row);
+                    }
+                    return;
+                }
+                visit(fn);
+            }
+
+        private:
+            template <class Function>
+            void visit(Function fn) const
+            {
+                if (full)
+                {
+                    product.for_each(index_type(0), product.max_size(), fn);
+                    return;
+                }
+                RandomIterator iter(origin);
+                while (iter.has_next())
+                {
+#ifdef USE_BOOST
+                    fn(lazy_cartesian_product::boost_entry_at(product.combinations(), iter.next(), product.stats()));
+#else
+                    fn(lazy_cartesian_product::entry_at(product.combinations(), iter.next(), product.stats()));
+#endif
+                }
+            }
+
+            const cartesian_product &product;
+            const RandomIterator    origin;
+            const bool              full;
+            memory_plan             plan;
+            vector<vector<string>>  rows;
+    };
+
+    class columnar_rows;
+
+    // One row of a columnar_rows, valid as long as the rows are.
+    class row_view
+    {
+        public:
+            row_view(const columnar_rows &rows, const unsigned long long &row): rows(&rows), row(row) {}
+
+            inline const unsigned long long size(void) const;
+            inline const string &operator[](const unsigned long long &dimension) const;
+            inline const unsigned long long value_index(const unsigned long long &dimension) const;
+            inline const vector<string> to_vector(void) const;
+
+        private:
+            const columnar_rows *rows;
+            unsigned long long  row;
+    };
+
+    // Rows stored as one column of value indices per dimension, each
+    // 1, 2 or 4 bytes wide depending on how many values the dimension has,
+    // alongside a reference to the dimension lists (which must outlive it).
+    // column(d) exposes the raw indices for scans, filters and group-bys.
+    class columnar_rows
+    {
+        public:
+            explicit columnar_rows(const vector<vector<string>> &combinations): spec(&combinations), count(0)
+            {
+                widths.resize(combinations.size());
+                columns.resize(combinations.size());
+                for (unsigned long long d = 0; d < combinations.size(); ++d)
+                {
+                    const unsigned long long size = combinations[d].size();
+                    widths[d] = size <= 0x100 ? 1 : size <= 0x10000 ? 2 : 4;
+                }
+            }
+            // The dimension lists are referenced, so temporaries are refused.
+            explicit columnar_rows(vector<vector<string>> &&combinations) = delete;
+
+            // The rows [first, last) of `product`, in index order.
+            static const columnar_rows range(const cartesian_product &product, const index_type &first, const index_type &last)
+            {
+                if (first > last || last > product.max_size())
+                {
+                    throw errors::index_error();
+                }
+                columnar_rows rows(product.combinations());
+                if (first == last)
+                {
+                    return rows;
+                }
+                rows.reserve((unsigned long long)(last - first));
+                vector<unsigned long long> digits = product.indices_at(first);
+                for (index_type i = first; i < last; ++i)
+                {
+                    rows.push_back(digits);
+                    for (long long d = digits.size() - 1; d >= 0; --d)
+                    {
+                        if (++digits[d] < (*rows.spec)[d].size())
+                        {
+                            break;
+                        }
+                        digits[d] = 0;
+                    }
+                }
+                return rows;
+            }
+            // A random sample of `product`, drawn as generate_samples draws it.
+            static const columnar_rows sample(const cartesian_product &product, const index_type &sample_size)
+            {
+                const sampling_plan plan = sampler::plan(product.max_size(), sample_size);
+                columnar_rows rows(product.combinations());
+                rows.reserve((unsigned long long)plan.sample_size);
+                sampler::draw(plan, [&](const index_type &index)
+                {
+                    rows.push_back(product.indices_at(index));
+                });
+                return rows;
+            }
+
+            void reserve(const unsigned long long &rows)
+            {
+                for (unsigned long long d = 0; d < columns.size(); ++d)
+                {
+                    columns[d].reserve(rows * widths[d]);
+                }
+            }
+            // Appends a row given the value index of every dimension.
+            void push_back(const vector<unsigned long long> &digits)
+            {
+                for (unsigned long long d = 0; d < columns.size(); ++d)
+                {
+                    vector<unsigned char> &column = columns[d];
+                    const unsigned long long at = column.size();
+                    column.resize(at + widths[d]);
+                    if (widths[d] == 1)
+                    {
+                        column[at] = (unsigned char)digits[d];
+                    }
+                    else if (widths[d] == 2)
+                    {
+                        const std::uint16_t index = (std::uint16_t)digits[d];
+                        std::memcpy(&column[at], &index, sizeof(index));
+                    }
+                    else
+                    {
+                        const std::uint32_t index = (std::uint32_t)digits[d];
+                        std::memcpy(&column[at], &index, sizeof(index));
+                    }
+                }
+                ++count;
+            }
+
+            const unsigned long long size(void) const
+            {
+                return count;
+            }
+            const unsigned long long dimensions(void) const
+            {
+                return columns.size();
+            }
+            const row_view operator[](const unsigned long long &row) const
+            {
+                return row_view(*this, row);
+            }
+            const unsigned long long value_index(const unsigned long long &row, const unsigned long long &dimension) const
+            {
+                const unsigned char *at = &columns[dimension][row * widths[dimension]];
+                if (widths[dimension] == 1)
+                {
+                    return *at;
+                }
+                if (widths[dimension] == 2)
+                {
+                    std::uint16_t index;
+                    std::memcpy(&index, at, sizeof(index));
+                    return index;
+                }
+                std::uint32_t index;
+                std::memcpy(&index, at, sizeof(index));
+                return index;
+            }
+            const string &value(const unsigned long long &row, const unsigned long long &dimension) const
+            {
+                return (*spec)[dimension][value_index(row, dimension)];
+            }
+            // The bytes per index of a column: 1 (uint8_t), 2 (uint16_t) or
+            // 4 (uint32_t).
+            const unsigned int width(const unsigned long long &dimension) const
+            {
+                return widths[dimension];
+            }
+            // The raw value indices of a column; cast to the type matching
+            // width(dimension).
+            const void *column(const unsigned long long &dimension) const
+            {
+                return columns[dimension].data();
+            }
+            const unsigned long long bytes(void) const
+            {
+                unsigned long long total = 0;
+                for (const vector<unsigned char> &column: columns)
+                {
+                    total += column.size();
+                }
+                return total;
+            }
+            const vector<vector<string>> &combinations(void) const
+            {
+                return *spec;
+            }
+
+        private:
+            const vector<vector<string>> *spec;
+            vector<unsigned int>          widths;
+            vector<vector<unsigned char>> columns;
+            unsigned long long            count;
+    };
+
+    inline const unsigned long long row_view::size(void) const
+    {
+        return rows->dimensions();
+    }
+    inline const string &row_view::operator[](const unsigned long long &dimension) const
+    {
+        return rows->value(row, dimension);
+    }
+    inline const unsigned long long row_view::value_index(const unsigned long long &dimension) const
+    {
+        return rows->value_index(row, dimension);
+    }
+    inline const vector<string> row_view::to_vector(void) const
+    {
+        vector<string> values(size());
+        for (unsigned long long d = 0; d < values.size(); ++d)
+        {
+            values[d] = (*this)[d];
+        }
+        return values;
+    }
+
+    // Enumerates a product along a Morton (Z-order) curve, so that rows that
+    // are close in curve order are close in every dimension. Each dimension
+    // is padded to a power of two and the bits of the value indices are
+    // interleaved, most significant level first; grid points outside the
+    // real sizes are skipped. Curve positions count only real rows, so they
+    // run from 0 to max_size() - 1, and rank()/unrank() translate them to and
+    // from canonical entry_at indices by counting the rows in the boxes that
+    // precede a point.
+    class morton_order
+    {
+        public:
+            explicit morton_order(const cartesian_product &product): product(product)
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                sizes.resize(combinations.size());
+                bits.resize(combinations.size());
+                unsigned int levels = 0;
+                for (unsigned long long d = 0; d < combinations.size(); ++d)
+                {
+                    sizes[d] = combinations[d].size();
+                    while (bits[d] < 64 && (1ULL << bits[d]) < sizes[d])
+                    {
+                        ++bits[d];
+                    }
+                    levels = bits[d] > levels ? bits[d] : levels;
+                }
+                for (unsigned int level = levels; level > 0; --level)
+                {
+                    for (unsigned long long d = 0; d < bits.size(); ++d)
+                    {
+                        if (bits[d] >= level)
+                        {
+                            steps.push_back(d);
+                        }
+                    }
+                }
+            }
+
+            const index_type &max_size(void) const
+            {
+                return product.max_size();
+            }
+            // The curve position of canonical index `index`.
+            const index_type rank(const index_type &index) const
+            {
+                const vector<unsigned long long> digits = product.indices_at(index);
+                vector<unsigned long long> low(sizes.size(), 0);
+                vector<unsigned int> free(bits);
+                index_type position = 0;
+                for (const unsigned long long &d: steps)
+                {
+                    const unsigned long long bit = 1ULL << --free[d];
+                    if (digits[d] & bit)
+                    {
+                        position += box(low, free);
+                        low[d] |= bit;
+                    }
+                }
+                return position;
+            }
+            // The canonical index of curve position `position`.
+            const index_type unrank(index_type position) const
+            {
+                if (position >= product.max_size())
+                {
+                    throw errors::index_error();
+                }
+                vector<unsigned long long> low(sizes.size(), 0);
+                vector<unsigned int> free(bits);
+                for (const unsigned long long &d: steps)
+                {
+                    const unsigned long long bit = 1ULL << --free[d];
+                    const index_type before = box(low, free);
+                    if (position >= before)
+                    {
+                        position -= before;
+                        low[d] |= bit;
+                    }
+                }
+
+                const precomputed_stats &ps = product.stats();
+                index_type index = 0;
+                for (unsigned long long d = 0; d < low.size(); ++d)
+                {
+                    index += ps.divs[d] * low[d];
+                }
+                return index;
+            }
+            // Calls `fn(row)` for the rows at curve positions [first, last).
+            template <class Function>
+            void for_each(const index_type &first, const index_type &last, Function fn) const
+            {
+                if (last > product.max_size())
+                {
+                    throw errors::index_error();
+                }
+                if (first >= last)
+                {
+                    return;
+                }
+                traversal<Function> walk(first, last, fn, sizes.size());
+                walk.free = bits;
+                visit(0, walk);
+            }
+
+        private:
+            template <class Function>
+            struct traversal
+            {
+                traversal(const index_type &first, const index_type &last, Function &fn, const unsigned long long &dimensions): first(first), last(last), fn(fn), position(0), low(dimensions, 0), shown(dimensions, ~0ULL), row(dimensions) {}
+
+                const index_type           first;
+                const index_type           last;
+                Function                   &fn;
+                index_type                 position;
+                vector<unsigned long long> low;
+                vector<unsigned int>       free;
+                vector<unsigned long long> shown;
+                vector<string>             row;
+            };
+
+            // The number of real rows whose value index in dimension d lies in
+            // [low[d], low[d] + 2^free[d]) for every d.
+            const index_type box(const vector<unsigned long long> &low, const vector<unsigned int> &free) const
+            {
+                index_type count = 1;
+                for (unsigned long long d = 0; d < sizes.size(); ++d)
+                {
+                    if (low[d] >= sizes[d])
+                    {
+                        return 0;
+                    }
+                    const unsigned long long left = sizes[d] - low[d];
+                    count *= free[d] < 64 && (1ULL << free[d]) < left ? (1ULL << free[d]) : left;
+                }
+                return count;
+            }
+            // Walks the subtree of boxes below step `k`, skipping boxes with
+            // no real rows and boxes entirely outside [first, last).
+            template <class Function>
+            void visit(const unsigned long long &k, traversal<Function> &walk) const
+            {
+                if (walk.position >= walk.last)
+                {
+                    return;
+                }
+                const index_type count = box(walk.low, walk.free);
+                if (count == 0)
+                {
+                    return;
+                }
+                if (walk.position + count <= walk.first)
+                {
+                    walk.position += count;
+                    return;
+                }
+                if (k == steps.size())
+                {
+                    const vector<vector<string>> &combinations = product.combinations();
+                    for (unsigned long long d = 0; d < walk.low.size(); ++d)
+                    {
+                        if (walk.shown[d] != walk.low[d])
+                        {
+                            walk.row[d] = combinations[d][walk.low[d]];
+                            walk.shown[d] = walk.low[d];
+                        }
+                    }
+                    walk.fn((const vector<string> &)walk.row);
+                    walk.position += 1;
+                    return;
+                }
+
+                const unsigned long long d = steps[k];
+                const unsigned long long bit = 1ULL << --walk.free[d];
+                visit(k + 1, walk);
+                walk.low[d] |= bit;
+                visit(k + 1, walk);
+                walk.low[d] &= ~bit;
+                ++walk.free[d];
+            }
+
+            const cartesian_product    &product;
+            vector<unsigned long long> sizes;
+            vector<unsigned int>       bits;
+            vector<unsigned long long> steps;
+    };
+
+    // Enumerates a product with the dimensions nested in a different order
+    // while returning rows in the original column order. `order` lists the
+    // original dimensions from outermost to innermost, so {2, 0, 1} makes
+    // dimension 1 vary fastest and dimension 2 slowest. The view has its own
+    // divs and mods (indexed by original dimension) and translates between
+    // its indices and canonical entry_at indices.
+    class permuted_view
+    {
+        public:
+            permuted_view(const cartesian_product &product, const vector<unsigned long long> &order): product(product), order(order)
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                vector<bool> seen(combinations.size(), false);
+                if (order.size() != combinations.size())
+                {
+                    throw errors::invalid_permutation_error();
+                }
+                for (const unsigned long long &d: order)
+                {
+                    if (d >= seen.size() || seen[d])
+                    {
+                        throw errors::invalid_permutation_error();
+                    }
+                    seen[d] = true;
+                }
+
+                view_divs.resize(combinations.size());
+                view_mods.resize(combinations.size());
+                index_type factor = 1;
+                for (long long k = order.size() - 1; k >= 0; --k)
+                {
+                    const unsigned long long d = order[k];
+                    view_divs[d] = factor;
+                    view_mods[d] = combinations[d].size();
+                    factor *= combinations[d].size();
+                }
+            }
+
+            const index_type &max_size(void) const
+            {
+                return product.max_size();
+            }
+            const vector<index_type> &divs(void) const
+            {
+                return view_divs;
+            }
+            const vector<index_type> &mods(void) const
+            {
+                return view_mods;
+            }
+            const vector<unsigned long long> indices_at(const index_type &index) const
+            {
+                if (index >= product.max_size())
+                {
+                    throw errors::index_error();
+                }
+                vector<unsigned long long> digits(view_divs.size());
+                for (unsigned long long d = 0; d < digits.size(); ++d)
+                {
+                    digits[d] = (unsigned long long)((index / view_divs[d]) % view_mods[d]);
+                }
+                return digits;
+            }
+            const vector<string> entry_at(const index_type &index) const
+            {
+                const vector<vector<string>> &combinations = product.combinations();
+                const vector<unsigned long long> digits = indices_at(index);
+                vector<string> row(digits.size());
+                for (unsigned long long d = 0; d < digits.size(); ++d)
+                {
+                    row[d] = combinations[d][digits[d]];
+                }
+                return row;
+            }
+            // The canonical index of the view's row `index`.
+            const index_type to_canonical(const index_type &index) const
+            {
+                const vector<unsigned long long> digits = indices_at(index);
+                const precomputed_stats &ps = product.stats();
+                index_type canonical = 0;
+                for (unsigned long long d = 0; d < digits.size(); ++d)
+                {
+                    canonical += ps.divs[d] * digits[d];
+                }
+                return canonical;
+            }
+            // The view's index of canonical index `index`.
+            const index_type from_canonical(const index_type &index) const
+            {
+                const vector<unsigned long long> digits = product.indices_at(index);
+                index_type permuted = 0;
+                for (unsigned long long d = 0; d < digits.size(); ++d)
+                {
+                    permuted += view_divs[d] * digits[d];
+                }
+                return permuted;
+            }
+            // Calls `fn(row)` for the view's rows [first, last).
+            template <class Function>
+            void for_each(const index_type &first, const index_type &last, Function fn) const
+            {
+                if (last > product.max_size())
+                {
+                    throw errors::index_error();
+                }
+                if (first >= last)
+                {
+                    return;
+                }
+                const vector<vector<string>> &combinations = product.combinations();
+                vector<unsigned long long> digits = indices_at(first);
+                vector<string> row = entry_at(first);
+                for (index_type i = first; i < last; ++i)
+                {
+                    fn((const vector<string> &)row);
+                    for (long long k = order.size() - 1; k >= 0; --k)
+                    {
+                        const unsigned long long d = order[k];
+                        if (++digits[d] < combinations[d].size())
+                        {
+                            row[d] = combinations[d][digits[d]];
+                            break;
+                        }
+                        digits[d] = 0;
+                        row[d] = combinations[d][0];
+                    }
+                }
+            }
+
+        private:
+            const cartesian_product          &product;
+            const vector<unsigned long long> order;
+            vector<index_type>               view_divs;
+            vector<index_type>               view_mods;
+    };
+
+    struct shard_info
+    {
+        index_type         first;
+        index_type         last;
+        unsigned long long bytes;
+        string             path;
+    };
+
+    // Describes an export split into files that each cover a contiguous range
+    // of rows. `source` is "product" (row i is product index i) or "sample"
+    // (row i is the i-th sampled row). In the "fixed" format every line is
+    // padded to `record_width` bytes including the newline.
+    struct shard_manifest
+    {
+        string             format;
+        string             delimiter;
+        unsigned long long record_width;
+        string             source;
+        index_type         rows;
+        vector<shard_info> shards;
+
+        void save(ostream &out) const
+        {
+            out << "lcp-manifest 1\n";
+            out << "format " << format << "\n";
+            out << "delimiter";
+            for (const char &c: delimiter)
+            {
+                out << " " << (unsigned int)(unsigned char)c;
+            }
+            out << "\n";
+            out << "width " << record_width << "\n";
+            out << "source " << source << "\n";
+            out << "rows " << rows << "\n";
+            out << "shards " << shards.size() << "\n";
+            for (const shard_info &shard: shards)
+            {
+                out << shard.first << " " << shard.last << " " << shard.bytes << " " << shard.path << "\n";
+            }
+        }
+        static const shard_manifest load(istream &in)
+        {
+            shard_manifest manifest;
+            string key, line;
+            int version = 0;
+            if (!(in >> key >> version) || key != "lcp-manifest" || version != 1
+                || !(in >> key >> manifest.format) || key != "format"
+                || !(in >> key) || key != "delimiter" || !std::getline(in, line))
+            {
+                throw errors::invalid_manifest_error();
+            }
+            std::istringstream bytes(line);
+            unsigned int c;
+            while (bytes >> c)
+            {
+                manifest.delimiter.push_back((char)c);
+            }
+
+            unsigned long long count = 0;
+            if (!(in >> key >> manifest.record_width) || key != "width"
+                || !(in >> key >> manifest.source) || key != "source"
+                || !(in >> key >> manifest.rows) || key != "rows"
+                || !(in >> key >> count) || key != "shards")
+            {
+                throw errors::invalid_manifest_error();
+            }
+            manifest.shards.resize(count);
+            for (shard_info &shard: manifest.shards)
+            {
+                if (!(in >> shard.first >> shard.last >> shard.bytes) || !std::getline(in >> std::ws, shard.path))
+                {
+                    throw errors::invalid_manifest_error();
+                }
+            }
+            return manifest;
+        }
+    };
+
+    // Writes a product or a sample as `shard_count` files named
+    // `<prefix>-<n>.<format>` plus `<prefix>.manifest`. The manifest lists the
+    // files relative to its own directory. Samples are drawn as
+    // generate_samples draws them; a "csv" sample also gets a `<file>.idx`
+    // next to every file holding the byte offset of each line as a native
+    // 64-bit integer.
+    class shard_writer
+    {
+        public:
+            static const shard_manifest write_product(const cartesian_product &product, const unsigned long long &shard_count, const string &prefix, const string &format = "csv", const string &delimiter = ",")
+            {
+                shard_manifest manifest = prepare(product, product.max_size(), shard_count, prefix, format, delimiter, "product");
+                for (shard_info &shard: manifest.shards)
+                {
+                    std::ofstream out((directory_of(prefix) + shard.path).c_str(), ios::binary | ios::trunc);
+                    if (!out)
+                    {
+                        throw errors::file_error();
+                    }
+                    string text;
+                    product.for_each(shard.first, shard.last, [&](const vector<string> &row)
+                    {
+                        append(manifest, row, text);
+                        if (text.size() >= LCP_OUTPUT_BUFFER_SIZE)
+                        {
+                            out.write(text.data(), text.size());
+                            shard.bytes += text.size();
+                            text.clear();
+                        }
+                    });
+                    out.write(text.data(), text.size());
+                    shard.bytes += text.size();
+                }
+                finish(manifest, prefix);
+                return manifest;
+            }
+            static const shard_manifest write_sample(const cartesian_product &product, const index_type &sample_size, const unsigned long long &shard_count, const string &prefix, const string &format = "csv", const string &delimiter = ",")
+            {
+                const sampling_plan plan = sampler::plan(product.max_size(), sample_size);
+                shard_manifest manifest = prepare(product, sample_size, shard_count, prefix, format, delimiter, "sample");
+                const bool indexed = manifest.format == "csv";
+
+                unsigned long long current = 0;
+                std::ofstream out, offsets;
+                string text, positions;
+                const auto open_shard = [&]()
+                {
+                    const string path = directory_of(prefix) + manifest.shards[current].path;
+                    out.open(path.c_str(), ios::binary | ios::trunc);
+                    if (indexed)
+                    {
+                        offsets.open((path + ".idx").c_str(), ios::binary | ios::trunc);
+                    }
+                    if (!out || (indexed && !offsets))
+                    {
+                        throw errors::file_error();
+                    }
+                };
+                const auto flush = [&]()
+                {
+                    out.write(text.data(), text.size());
+                    manifest.shards[current].bytes += text.size();
+                    text.clear();
+                    offsets.write(positions.data(), positions.size());
+                    positions.clear();
+                };
+                const auto close_shard = [&]()
+                {
+                    flush();
+                    out.close();
+                    if (indexed)
+                    {
+                        offsets.close();
+                    }
+                };
+
+                open_shard();
+                index_type row = 0;
+                sampler::draw(plan, [&](const index_type &index)
+                {
+                    while (row == manifest.shards[current].last)
+                    {
+                        close_shard();
+                        ++current;
+                        open_shard();
+                    }
+                    if (indexed)
+                    {
+                        const unsigned long long offset = manifest.shards[current].bytes + text.size();
+                        positions.append((const char *)&offset, sizeof(offset));
+                    }
+#ifdef USE_BOOST
+                    append(manifest, lazy_cartesian_product::boost_entry_at(product.combinations(), index, product.stats()), text);
+#else
+                    append(manifest, lazy_cartesian_product::entry_at(product.combinations(), index, product.stats()), text);
+#endif
+                    if (text.size() >= LCP_OUTPUT_BUFFER_SIZE)
+                    {
+                        flush();
+                    }
+                    ++row;
+                });
+                close_shard();
+                while (++current < manifest.shards.size())
+                {
+                    open_shard();
+                    close_shard();
+                }
+                finish(manifest, prefix);
+                return manifest;
+            }
+
+        private:
+            static const shard_manifest prepare(const cartesian_product &product, const index_type &rows, const unsigned long long &shard_count, const string &prefix, const string &format, const string &delimiter, const string &source)
+            {
+                if (format != "csv" && format != "fixed")
+                {
+                    throw errors::invalid_manifest_error();
+                }
+
+                shard_manifest manifest;
+                manifest.format = format;
+                manifest.delimiter = delimiter;
+                manifest.record_width = 0;
+                manifest.source = source;
+                manifest.rows = rows;
+                if (format == "fixed")
+                {
+                    const vector<vector<string>> &combinations = product.combinations();
+                    manifest.record_width = 1 + (combinations.size() - 1) * delimiter.size();
+                    for (const vector<string> &values: combinations)
+                    {
+                        unsigned long long widest = 0;
+                        for (const string &value: values)
+                        {
+                            widest = value.size() > widest ? value.size() : widest;
+                        }
+                        manifest.record_width += widest;
+                    }
+                }
+
+                const unsigned long long count = shard_count > 0 ? shard_count : 1;
+                for (unsigned long long k = 0; k < count; ++k)
+                {
+                    std::ostringstream path;
+                    path << prefix.substr(directory_of(prefix).size()) << "-" << std::setw(5) << std::setfill('0') << k << "." << format;
+                    shard_info shard;
+                    shard.first = bound(rows, k, count);
+                    shard.last = bound(rows, k + 1, count);
+                    shard.bytes = 0;
+                    shard.path = path.str();
+                    manifest.shards.push_back(shard);
+                }
+                return manifest;
+            }
+            // rows * k / count without overflowing the intermediate product.
+            static const index_type bound(const index_type &rows, const unsigned long long &k, const unsigned long long &count)
+            {
+                return rows / count * k + rows % count * k / count;
+            }
+            static const string directory_of(const string &path)
+            {
+                const string::size_type slash = path.find_last_of('/');
+                return slash == string::npos ? string() : path.substr(0, slash + 1);
+            }
+            static void append(const shard_manifest &manifest, const vector<string> &row, string &text)
+            {
+                const unsigned long long start = text.size();
+                for (unsigned long long d = 0; d < row.size(); ++d)
+                {
+                    if (d > 0)
+                    {
+                        text.append(manifest.delimiter);
+                    }
+                    text.append(row[d]);
+                }
+                if (manifest.record_width > 0)
+                {
+                    text.append(manifest.record_width - 1 - (text.size() - start), ' ');
+                }
+                text.push_back('\n');
+            }
+            static void finish(const shard_manifest &manifest, const string &prefix)
+            {
+                std::ofstream out((prefix + ".manifest").c_str(), ios::trunc);
+                if (!out)
+                {
+                    throw errors::file_error();
+                }
+                manifest.save(out);
+            }
+    };
+
+    // Fetches single rows from a sharded export: a binary search over the
+    // manifest finds the file, and one seek finds the line. "fixed" exports
+    // need nothing else; "csv" samples read the offset from the file's .idx;
+    // "csv" exports of a whole product compute the byte offset of a row from
+    // the value lengths, so they need the product.
+    class shard_reader
+    {
+        public:
+            shard_reader(const string &manifest_path, const cartesian_product *product = 0): product(product)
+            {
+                std::ifstream in(manifest_path.c_str());
+                if (!in)
+                {
+                    throw errors::file_error();
+                }
+                manifest = shard_manifest::load(in);
+                if (manifest.format == "csv" && manifest.source == "product" && !product)
+                {
+                    throw errors::invalid_manifest_error();
+                }
+                files.resize(manifest.shards.size());
+                indexes.resize(manifest.shards.size());
+
+                string directory;
+                const string::size_type slash = manifest_path.find_last_of('/');
+                if (slash != string::npos)
+                {
+                    directory = manifest_path.substr(0, slash + 1);
+                }
+                for (shard_info &shard: manifest.shards)
+                {
+                    shard.path = directory + shard.path;
+                }
+
+                if (product)
+                {
+                    const vector<vector<string>> &combinations = product->combinations();
+                    prefix_lengths.resize(combinations.size());
+                    for (unsigned long long d = 0; d < combinations.size(); ++d)
+                    {
+                        prefix_lengths[d].push_back(0);
+                        for (const string &value: combinations[d])
+                        {
+                            prefix_lengths[d].push_back(prefix_lengths[d].back() + value.size());
+                        }
+                    }
+                }
+            }
+
+            // The text of row `index`, without the newline (or the padding of
+            // the "fixed" format).
+            const string row(const index_type &index)
+            {
+                if (index >= manifest.rows)
+                {
+                    throw errors::index_error();
+                }
+
+                unsigned long long low = 0, high = manifest.shards.size() - 1;
+                while (low < high)
+                {
+                    const unsigned long long middle = low + (high - low) / 2;
+                    if (manifest.shards[middle].last <= index)
+                    {
+                        low = middle + 1;
+                    }
+                    else
+                    {
+                        high = middle;
+                    }
+                }
+                const shard_info &shard = manifest.shards[low];
+                unsigned long long offset;
+                if (manifest.format == "fixed")
+                {
+                    offset = (unsigned long long)(index - shard.first) * manifest.record_width;
+                }
+                else if (manifest.source == "product")
+                {
+                    offset = (unsigned long long)(bytes_before(index) - bytes_before(shard.first));
+                }
+                else
+                {
+                    std::ifstream &positions = open(indexes, low, shard.path + ".idx");
+                    positions.clear();
+                    positions.seekg((unsigned long long)(index - shard.first) * sizeof(offset));
+                    if (!positions.read((char *)&offset, sizeof(offset)))
+                    {
+                        throw errors::file_error();
+                    }
+                }
+
+                std::ifstream &in = open(files, low, shard.path);
+                in.clear();
+                in.seekg(offset);
+                string line;
+                std::getline(in, line);
+                if (manifest.format == "fixed")
+                {
+                    const string::size_type end = line.find_last_not_of(' ');
+                    line.erase(end == string::npos ? 0 : end + 1);
+                }
+                return line;
+            }
+            const shard_manifest &info(void) const
+            {
+                return manifest;
+            }
+
+        private:
+            static std::ifstream &open(vector<std::unique_ptr<std::ifstream>> &streams, const unsigned long long &shard, const string &path)
+            {
+                if (!streams[shard])
+                {
+                    streams[shard].reset(new std::ifstream(path.c_str(), ios::binary));
+                    if (!*streams[shard])
+                    {
+                        streams[shard].reset();
+                        throw errors::file_error();
+                    }
+                }
+                return *streams[shard];
+            }
+            // Bytes taken by the csv lines of product rows [0, index).
+            const index_type bytes_before(const index_type &index) const
+            {
+                const vector<vector<string>> &combinations = product->combinations();
+                const precomputed_stats &ps = product->stats();
+                index_type bytes = index * ((combinations.size() - 1) * manifest.delimiter.size() + 1);
+                for (unsigned long long d = 0; d < combinations.size(); ++d)
+                {
+                    const index_type &div = ps.divs[d];
+                    const unsigned long long size = combinations[d].size();
+                    const index_type period = div * size;
+                    const index_type rest = index % period;
+                    const unsigned long long value = (unsigned long long)(rest / div);
+                    bytes += (index / period) * div * prefix_lengths[d][size];
+                    bytes += div * prefix_lengths[d][value];
+                    bytes += (rest % div) * combinations[d][value].size();
+                }
+                return bytes;
+            }
+
+            const cartesian_product                   *product;
+            shard_manifest                            manifest;
+            vector<std::unique_ptr<std::ifstream>>    files;
+            vector<std::unique_ptr<std::ifstream>>    indexes;
+            vector<vector<unsigned long long>>        prefix_lengths;
+    };
+
+#ifdef LCP_HAS_SHARED_MEMORY
+    // Hands out chunks of an index range to cooperating processes on one host
+    // through a POSIX shared-memory ledger. The first process to open a name
+    // creates and initializes the ledger; the others attach to it. Every chunk
+    // slot holds its owner (claim generation and pid) and a lease timestamp.
+    // A chunk whose owner has exited, or whose lease has not been renewed for
+    // `lease_ms` milliseconds, is handed out again. Call remove() once the
+    // job is over to unlink the ledger.
+    class chunk_ledger
+    {
+        public:
+            chunk_ledger(const string &name, const index_type &total, const unsigned long long &chunk_rows, const unsigned long long &lease_ms = 30000): name(name), total(total), chunk_rows(chunk_rows > 0 ? chunk_rows : 1), header(0), slots(0), bytes(0)
+            {
+                const index_type chunks = (total + this->chunk_rows - 1) / this->chunk_rows;
+                chunk_count = (unsigned long long)chunks;
+                if (chunk_count != chunks)
+                {
+                    throw errors::index_error();
+                }
+                bytes = sizeof(ledger_header) + chunk_count * sizeof(ledger_slot);
+                open(lease_ms);
+            }
+            ~chunk_ledger()
+            {
+                if (header)
+                {
+                    unmap();
+                }
+            }
+
+            // Claims a chunk for this process. Returns false when every chunk is
+            // done or held by a live owner with a current lease.
+            const bool claim(unsigned long long &chunk)
+            {
+                const unsigned long long mine = (header->generation.fetch_add(1) << 32) | (unsigned long long)getpid();
+                for (unsigned long long i = header->next.fetch_add(1); i < chunk_count; i = header->next.fetch_add(1))
+                {
+                    // The lease is written before the owner so that no other
+                    // process can see the new owner with a stale lease.
+                    slots[i].lease.store(now(), std::memory_order_release);
+                    unsigned long long expected = free_slot;
+                    if (slots[i].owner.compare_exchange_strong(expected, mine))
+                    {
+                        hold(i, mine);
+                        chunk = i;
+                        return true;
+                    }
+                }
+
+                for (unsigned long long i = 0; i < chunk_count; ++i)
+                {
+                    unsigned long long owner = slots[i].owner.load(std::memory_order_acquire);
+                    if (owner == done_slot || (owner != free_slot && !abandoned(slots[i], owner)))
+                    {
+                        continue;
+                    }
+                    slots[i].lease.store(now(), std::memory_order_release);
+                    if (slots[i].owner.compare_exchange_strong(owner, mine))
+                    {
+                        hold(i, mine);
+                        chunk = i;
+                        return true;
+                    }
+                }
+                return false;
+            }
+            // Extends the lease of a chunk that is taking long to produce.
+            // Returns false if the chunk has been handed to another process,
+            // which then owns its output.
+            const bool renew(const unsigned long long &chunk)
+            {
+                const unsigned long long mine = held(chunk);
+                if (mine == free_slot || slots[chunk].owner.load(std::memory_order_acquire) != mine)
+                {
+                    return false;
+                }
+                slots[chunk].lease.store(now(), std::memory_order_release);
+                return slots[chunk].owner.load(std::memory_order_acquire) == mine;
+            }
+            // Marks a chunk claimed by this object as done. Returns false if
+            // its lease expired and another process claimed it meanwhile.
+            const bool complete(const unsigned long long &chunk)
+            {
+                unsigned long long mine = held(chunk);
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    owners.erase(chunk);
+                }
+                if (mine == free_slot || !slots[chunk].owner.compare_exchange_strong(mine, done_slot))
+                {
+                    return false;
+                }
+                header->done.fetch_add(1);
+                return true;
+            }
+            // The index range [first, last) covered by a chunk.
+            void range(const unsigned long long &chunk, index_type &first, index_type &last) const
+            {
+                first = index_type(chunk) * chunk_rows;
+                last = first + chunk_rows;
+                if (last > total)
+                {
+                    last = total;
+                }
+            }
+
+            const unsigned long long chunks(void) const
+            {
+                return chunk_count;
+            }
+            const unsigned long long completed(void) const
+            {
+                return header->done.load(std::memory_order_acquire);
+            }
+            const bool finished(void) const
+            {
+                return completed() == chunk_count;
+            }
+            static void remove(const string &name)
+            {
+                shm_unlink(name.c_str());
+            }
+
+        private:
+            static const unsigned long long ledger_magic = 0x6c63706c65646772ULL;
+            static const unsigned long long free_slot = 0;
+            static const unsigned long long done_slot = ~0ULL;
+
+            struct ledger_header
+            {
+                std::atomic<unsigned long long> magic;
+                unsigned long long              chunk_count;
+                unsigned long long              chunk_rows;
+                unsigned long long              lease_ms;
+                std::atomic<unsigned long long> generation;
+                std::atomic<unsigned long long> next;
+                std::atomic<unsigned long long> done;
+            };
+            struct ledger_slot
+            {
+                std::atomic<unsigned long long> owner;
+                std::atomic<unsigned long long> lease;
+            };
+
+            static const unsigned long long now(void)
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+            }
+            // Whether `owner`, as read from the slot, has exited or let its
+            // lease expire. The owner is read again after the lease so that a
+            // lease written by a newer owner is never judged against `owner`.
+            const bool abandoned(const ledger_slot &slot, const unsigned long long &owner) const
+            {
+                const pid_t pid = (pid_t)(owner & 0xffffffffULL);
+                const bool exited = kill(pid, 0) == -1 && errno == ESRCH;
+                const unsigned long long lease = slot.lease.load(std::memory_order_acquire);
+                if (slot.owner.load(std::memory_order_acquire) != owner)
+                {
+                    return false;
+                }
+                if (exited)
+                {
+                    return true;
+                }
+                const unsigned long long current = now();
+                return header->lease_ms > 0 && current > lease && current - lease > header->lease_ms;
+            }
+            void hold(const unsigned long long &chunk, const unsigned long long &owner)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                owners[chunk] = owner;
+            }
+            const unsigned long long held(const unsigned long long &chunk)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                std::map<unsigned long long, unsigned long long>::const_iterator found = owners.find(chunk);
+                return found == owners.end() ? free_slot : found->second;
+            }
+            void open(const unsigned long long &lease_ms)
+            {
+                bool created = true;
+                int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+                if (fd == -1 && errno == EEXIST)
+                {
+                    created = false;
+                    fd = shm_open(name.c_str(), O_RDWR, 0600);
+                }
+                if (fd == -1)
+                {
+                    throw errors::shared_memory_error();
+                }
+
+                if (created && ftruncate(fd, bytes) == -1)
+                {
+                    ::close(fd);
+                    shm_unlink(name.c_str());
+                    throw errors::shared_memory_error();
+                }
+                struct stat info;
+                for (int attempt = 0; !created; ++attempt)
+                {
+                    if (fstat(fd, &info) == -1 || attempt == 1000)
+                    {
+                        ::close(fd);
+                        throw errors::shared_memory_error();
+                    }
+                    if ((unsigned long long)info.st_size >= bytes)
+                    {
+                        break;
+                    }
+                    wait_briefly();
+                }
+
+                void *memory = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (memory == MAP_FAILED)
+                {
+                    throw errors::shared_memory_error();
+                }
+                header = static_cast<ledger_header *>(memory);
+                slots = reinterpret_cast<ledger_slot *>(header + 1);
+
+                if (created)
+                {
+                    header->chunk_count = chunk_count;
+                    header->chunk_rows = chunk_rows;
+                    header->lease_ms = lease_ms;
+                    header->generation.store(1);
+                    header->next.store(0);
+                    header->done.store(0);
+                    for (unsigned long long i = 0; i < chunk_count; ++i)
+                    {
+                        slots[i].owner.store(free_slot);
+                        slots[i].lease.store(0);
+                    }
+                    header->magic.store(ledger_magic, std::memory_order_release);
+                    return;
+                }
+
+                for (int attempt = 0; header->magic.load(std::memory_order_acquire) != ledger_magic; ++attempt)
+                {
+                    if (attempt == 1000)
+                    {
+                        unmap();
+                        throw errors::shared_memory_error();
+                    }
+                    wait_briefly();
+                }
+                if (header->chunk_count != chunk_count || header->chunk_rows != chunk_rows)
+                {
+                    unmap();
+                    throw errors::shared_memory_error();
+                }
+            }
+            // Waits a millisecond for another process to set the ledger up.
+            static void wait_briefly(void)
+            {
+                const timespec delay = {0, 1000000};
+                nanosleep(&delay, 0);
+            }
+            void unmap(void)
+            {
+                munmap(header, bytes);
+                header = 0;
+                slots = 0;
+            }
+
+            const string             name;
+            const index_type         total;
+            const unsigned long long chunk_rows;
+            unsigned long long       chunk_count;
+            ledger_header            *header;
+            ledger_slot              *slots;
+            unsigned long long       bytes;
+            std::mutex               lock;
+            std::map<unsigned long long, unsigned long long> owners;
+    };
+#endif
 }
 #endif